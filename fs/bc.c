@@ -1,6 +1,58 @@
 
 #include "fs.h"
 
+// Missing blocks are read in here, up to MAXRUN at a time, before they
+// appear in the cache, so that no other thread sees a block half read.
+// bc_lock guards it, and the cache bookkeeping below.
+#define BCTEMP		((char *) UTEMP)
+static struct Mutex bc_lock;
+
+// The blocks in the cache, in no particular order: bc_pgfault adds
+// them, and once bc_budget are in, a CLOCK hand sweeps over the table
+// to pick one to evict.  Entries whose page has been unmapped some
+// other way just wait for the hand to drop them.
+static uint32_t bc_blocks[BCMAXBLOCKS];
+static uint32_t bc_hand;
+static struct BcStat bc_stats = { .bs_budget = BCBUDGET };
+
+// Blocks whose changes the journal has not committed yet: they must not
+// reach their place on disk before then.  Only the block write queue
+// changes these bits.
+static uint32_t bc_pins[DISKSIZE / BLKSIZE / 32];
+
+// Blocks of compressed files: these are compressed on their way to the
+// disk and decompressed on their way back (see struct ZHeader).  The
+// file system marks a block before it uses it; readers may do that
+// concurrently, hence the atomic updates.
+static uint32_t bc_zmap[DISKSIZE / BLKSIZE / 32];
+
+// Where a compressed block is put together before it is written.
+// bc_lock guards it.
+static char bc_zbuf[BLKSIZE];
+
+// Most compressed bytes a block may take: it must save a sector.
+#define ZMAXLEN		(BLKSIZE - SECTSIZE - sizeof(struct ZHeader))
+
+// The blocks the file system has changed and not written back yet, in
+// the order they were first changed, with when that was, so that
+// write-back and sync need not look at every block.  bc_dirtymap says
+// which blocks are in the list; an entry whose bit has been cleared
+// since (because eviction wrote the block back) is skipped.  If the
+// list overflows, bc_dirty_lost tells sync to look at every block.
+#define BCDIRTYMAX	(2 * BCMAXBLOCKS)
+
+struct Dirty {
+	uint32_t d_blockno;
+	uint32_t d_since;	// sys_time_msec() when it was first changed
+};
+
+static struct Dirty bc_dirtylist[BCDIRTYMAX];
+static uint32_t bc_dirty_head, bc_dirty_tail;
+static uint32_t bc_dirtymap[DISKSIZE / BLKSIZE / 32];
+static uint32_t bc_ndirty;
+static bool bc_dirty_lost;
+static struct Mutex bc_dirty_lock;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,6 +76,429 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Pin block blockno in the cache, or unpin it.
+void
+bc_pin(uint32_t blockno, bool pin)
+{
+	if (pin)
+		bc_pins[blockno / 32] |= 1 << (blockno % 32);
+	else
+		bc_pins[blockno / 32] &= ~(1 << (blockno % 32));
+}
+
+bool
+bc_pinned(uint32_t blockno)
+{
+	return (bc_pins[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+// Note whether block blockno is stored compressed.
+void
+bc_zmark(uint32_t blockno, bool compressed)
+{
+	if (compressed)
+		__sync_fetch_and_or(&bc_zmap[blockno / 32], 1 << (blockno % 32));
+	else
+		__sync_fetch_and_and(&bc_zmap[blockno / 32], ~(1 << (blockno % 32)));
+}
+
+static bool
+bc_zmarked(uint32_t blockno)
+{
+	return (bc_zmap[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+// Move nsecs sectors between the disk and memory for the cache,
+// counting them.
+static void
+bc_ide(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	int r;
+
+	if (write)
+		r = disk_write(secno, buf, nsecs);
+	else
+		r = disk_read(secno, buf, nsecs);
+	if (r < 0)
+		panic("block cache: disk_%s: %e", write ? "write" : "read", r);
+	bc_stats.bs_sectors += nsecs;
+}
+
+// Write the block at va to block blockno, which is stored compressed:
+// only the sectors the compressed data needs, unless it does not
+// compress.  Called with bc_lock held.
+static void
+bc_zwrite(uint32_t blockno, void *va)
+{
+	struct ZHeader *zh = (struct ZHeader *) bc_zbuf;
+	uint32_t n;
+
+	if ((n = lz_compress(va, BLKSIZE, zh + 1, ZMAXLEN)) == 0) {
+		bc_ide(blockno * BLKSECTS, va, BLKSECTS, true);
+		return;
+	}
+	zh->zh_magic = ZHDR_MAGIC;
+	zh->zh_len = n;
+	zh->zh_sum = lz_checksum(va, BLKSIZE);
+	bc_ide(blockno * BLKSECTS, bc_zbuf,
+	       ROUNDUP(sizeof(*zh) + n, SECTSIZE) / SECTSIZE, true);
+}
+
+// Write the n blocks from blockno on, mapped at va, to the disk.
+// Called with bc_lock held, unless none of them is compressed.
+static void
+bc_write(uint32_t blockno, void *va, uint32_t n)
+{
+	if (n == 1 && bc_zmarked(blockno))
+		bc_zwrite(blockno, va);
+	else
+		bc_ide(blockno * BLKSECTS, va, n * BLKSECTS, true);
+}
+
+// Note that the file system has changed the block at va.
+void
+bc_dirty(void *va)
+{
+	uint32_t blockno = ((uint32_t) va - DISKMAP) / BLKSIZE;
+	uint32_t bit = 1 << (blockno % 32);
+
+	mutex_lock(&bc_dirty_lock);
+	if (!(bc_dirtymap[blockno / 32] & bit)) {
+		if (bc_dirty_tail - bc_dirty_head == BCDIRTYMAX)
+			bc_dirty_lost = 1;
+		else {
+			bc_dirtylist[bc_dirty_tail % BCDIRTYMAX].d_blockno = blockno;
+			bc_dirtylist[bc_dirty_tail % BCDIRTYMAX].d_since = sys_time_msec();
+			bc_dirty_tail++;
+			bc_dirtymap[blockno / 32] |= bit;
+			bc_ndirty++;
+		}
+	}
+	mutex_unlock(&bc_dirty_lock);
+}
+
+// Take blockno out of the dirty list, since it has been written back.
+static void
+bc_clean(uint32_t blockno)
+{
+	uint32_t bit = 1 << (blockno % 32);
+
+	mutex_lock(&bc_dirty_lock);
+	if (bc_dirtymap[blockno / 32] & bit) {
+		bc_dirtymap[blockno / 32] &= ~bit;
+		bc_ndirty--;
+	}
+	mutex_unlock(&bc_dirty_lock);
+}
+
+// Take up to n blocks that were changed no later than time since (in
+// sys_time_msec terms) off the dirty list, oldest first, and store them
+// in blocks.  The caller is to write them back.  Returns how many it
+// took, or -1 if blocks may have been lost from the list: then every
+// block must be checked.
+int
+bc_take_dirty(uint32_t *blocks, int n, uint32_t since)
+{
+	struct Dirty *d;
+	int i = 0;
+
+	mutex_lock(&bc_dirty_lock);
+	if (bc_dirty_lost) {
+		bc_dirty_lost = 0;
+		bc_dirty_head = bc_dirty_tail = bc_ndirty = 0;
+		memset(bc_dirtymap, 0, sizeof(bc_dirtymap));
+		mutex_unlock(&bc_dirty_lock);
+		return -1;
+	}
+	for (; bc_dirty_head != bc_dirty_tail && i < n; bc_dirty_head++) {
+		d = &bc_dirtylist[bc_dirty_head % BCDIRTYMAX];
+		if (!(bc_dirtymap[d->d_blockno / 32] & (1 << (d->d_blockno % 32))))
+			continue;
+		if ((int32_t) (d->d_since - since) > 0)
+			break;
+		bc_dirtymap[d->d_blockno / 32] &= ~(1 << (d->d_blockno % 32));
+		bc_ndirty--;
+		blocks[i++] = d->d_blockno;
+	}
+	mutex_unlock(&bc_dirty_lock);
+	return i;
+}
+
+// How many blocks are waiting to be written back.
+uint32_t
+bc_dirty_count(void)
+{
+	return bc_ndirty;
+}
+
+// Take entry i out of the table.
+static void
+bc_drop(uint32_t i)
+{
+	bc_blocks[i] = bc_blocks[--bc_stats.bs_resident];
+}
+
+// Evict one block from the cache, writing it back first if it is
+// dirty.  The hand gives blocks that were accessed since it last came
+// by a second chance, clearing PTE_A.  If two sweeps find nothing,
+// it takes what it finds.  It never takes a block that is mapped
+// anywhere else (by a client, through FSREQ_MAP or fmap, or at a
+// worker's w_readva), so that later writes still show through, nor a
+// dirty pinned block: its changes are not committed yet, and must not
+// reach their place on disk before they are.  The superblock and the
+// bitmap blocks stay for good: diskaddr reads the superblock with
+// bc_lock held, and faulting it back in then would deadlock.
+// Returns 1 if it evicted a block, 0 if it could only have taken dirty
+// pinned blocks (the caller then has to commit them, see
+// bc_make_room), -1 if there is none it may take at all.  Called with
+// bc_lock held.
+static int
+bc_evict(void)
+{
+	uint32_t i, steps, nkeep;
+	bool pinned = false;
+	void *va;
+	int r;
+
+	nkeep = 2 + (super ? ROUNDUP(super->s_nblocks, BLKBITSIZE) / BLKBITSIZE : 0);
+	for (steps = 0; ; steps++, bc_hand++) {
+		// (and an empty cache stops here, before dividing by 0)
+		if (steps >= 3 * bc_stats.bs_resident)
+			return pinned ? 0 : -1;
+		i = bc_hand % bc_stats.bs_resident;
+		if (bc_blocks[i] < nkeep)
+			continue;
+		va = diskaddr(bc_blocks[i]);
+		if (!va_is_mapped(va)) {
+			bc_drop(i);
+			return 1;
+		}
+		if (bc_pinned(bc_blocks[i]) && va_is_dirty(va)) {
+			pinned = true;
+			continue;
+		}
+		if (pageref(va) > 1)
+			continue;
+		if (steps >= 2 * bc_stats.bs_resident)
+			break;
+		if (!(uvpt[PGNUM(va)] & PTE_A))
+			break;
+		// Remapping the page clears PTE_A, but PTE_D too,
+		// so write dirty blocks back first.
+		if (va_is_dirty(va)) {
+			flush_block(va);
+			bc_stats.bs_writebacks++;
+			bc_clean(bc_blocks[i]);
+		} else if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+			panic("in bc_evict, sys_page_map: %e", r);
+	}
+
+	if (va_is_dirty(va)) {
+		flush_block(va);
+		bc_stats.bs_writebacks++;
+		bc_clean(bc_blocks[i]);
+	}
+	if ((r = sys_page_unmap(0, va)) < 0)
+		panic("in bc_evict, sys_page_unmap: %e", r);
+	bc_drop(i);
+	bc_stats.bs_evictions++;
+	return 1;
+}
+
+// Evict blocks until n more fit in the budget.  If dirty pinned blocks
+// stand in the way, commit them, which unpins them, and go on; if
+// clients map all that is left, go over the budget.  Called with
+// bc_lock held, which is let go for the commit: lock order puts
+// blkq_run's locks first.  Returns false if it had to let go, so the
+// caller must look again at what it checked under the lock.
+static bool
+bc_make_room(uint32_t n)
+{
+	bool held = true;
+	int r;
+
+	while (bc_stats.bs_resident + n > bc_stats.bs_budget) {
+		if ((r = bc_evict()) > 0)
+			continue;
+		if (r < 0) {
+			if (bc_stats.bs_resident + n > BCMAXBLOCKS)
+				panic("block cache: clients map every block");
+			break;
+		}
+		mutex_unlock(&bc_lock);
+		blkq_run();
+		mutex_lock(&bc_lock);
+		held = false;
+	}
+	return held;
+}
+
+// Note that the FS looked up the block cache page at va, for the
+// statistics: it is a hit unless the access is about to fault.
+void
+bc_lookup(void *va)
+{
+	if (va_is_mapped(va))
+		atomic_add(&bc_stats.bs_hits, 1);
+}
+
+// Copy the statistics into *st.  If budget is nonzero, first make it
+// the most blocks the cache may hold; the cache shrinks to fit as
+// blocks are read in.
+// Returns 0 on success, -E_INVAL if budget is out of range.
+int
+bc_stat(uint32_t budget, struct BcStat *st)
+{
+	if (budget && (budget < BCMINBLOCKS || budget > BCMAXBLOCKS))
+		return -E_INVAL;
+	mutex_lock(&bc_lock);
+	if (budget)
+		bc_stats.bs_budget = budget;
+	*st = bc_stats;
+	st->bs_dirty = bc_ndirty;
+	mutex_unlock(&bc_lock);
+	return 0;
+}
+
+// Make the page at pg the (clean) cache page of block blockno, and
+// unmap it from pg.  Called with bc_lock held.
+static void
+bc_insert(uint32_t blockno, void *pg)
+{
+	int r;
+
+	if ((r = sys_page_map(0, pg, 0, diskaddr(blockno), PTE_U|PTE_W|PTE_P)) < 0)
+		panic("in bc_insert, sys_page_map: %e", r);
+	sys_page_unmap(0, pg);
+	bc_blocks[bc_stats.bs_resident++] = blockno;
+}
+
+// Read the n blocks from blockno on, none of them compressed, into the
+// cache with one IDE command.  Called with bc_lock held.
+static void
+bc_read_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, BCTEMP + i * PGSIZE, PTE_U|PTE_W|PTE_P)) < 0)
+			panic("in bc_read, sys_page_alloc: %e", r);
+	bc_ide(blockno * BLKSECTS, BCTEMP, n * BLKSECTS, false);
+	// The new mappings start out clean, since only BCTEMP was written.
+	for (i = 0; i < n; i++)
+		bc_insert(blockno + i, BCTEMP + i * PGSIZE);
+}
+
+// Read block blockno, which is stored compressed, into the cache,
+// reading only as many sectors as its compressed data takes.  Called
+// with bc_lock held.
+static void
+bc_zread(uint32_t blockno)
+{
+	struct ZHeader *zh = (struct ZHeader *) BCTEMP;
+	char *pg = BCTEMP + PGSIZE;
+	uint32_t nsect = 1;
+	int r;
+
+	if ((r = sys_page_alloc(0, BCTEMP, PTE_U|PTE_W|PTE_P)) < 0
+	    || (r = sys_page_alloc(0, pg, PTE_U|PTE_W|PTE_P)) < 0)
+		panic("in bc_zread, sys_page_alloc: %e", r);
+	bc_ide(blockno * BLKSECTS, BCTEMP, 1, false);
+	if (zh->zh_magic == ZHDR_MAGIC && zh->zh_len <= ZMAXLEN) {
+		nsect = ROUNDUP(sizeof(*zh) + zh->zh_len, SECTSIZE) / SECTSIZE;
+		if (nsect > 1)
+			bc_ide(blockno * BLKSECTS + 1, BCTEMP + SECTSIZE,
+			       nsect - 1, false);
+		if (lz_decompress(zh + 1, zh->zh_len, pg, BLKSIZE) == BLKSIZE
+		    && lz_checksum(pg, BLKSIZE) == zh->zh_sum) {
+			bc_insert(blockno, pg);
+			sys_page_unmap(0, BCTEMP);
+			return;
+		}
+	}
+	// It did not compress, and is stored as it is.
+	bc_ide(blockno * BLKSECTS + nsect, BCTEMP + nsect * SECTSIZE,
+	       BLKSECTS - nsect, false);
+	bc_insert(blockno, BCTEMP);
+	sys_page_unmap(0, pg);
+}
+
+// Read the n blocks from blockno on, none of them in the cache, into
+// the cache: each run of uncompressed ones with one IDE command, and
+// the compressed ones one by one.  Called with bc_lock held, and room
+// made for them.
+static void
+bc_read(uint32_t blockno, uint32_t n)
+{
+	uint32_t i, m;
+
+	assert(n <= MAXRUN);
+	for (i = 0; i < n; i += m) {
+		m = 1;
+		if (bc_zmarked(blockno + i)) {
+			bc_zread(blockno + i);
+			continue;
+		}
+		while (i + m < n && !bc_zmarked(blockno + i + m))
+			m++;
+		bc_read_run(blockno + i, m);
+	}
+}
+
+// Make the page at pg the cache page of block blockno, dirty, and unmap
+// it from pg.  For blocks whose data was written before they had a
+// place on disk.
+void
+bc_adopt(uint32_t blockno, void *pg)
+{
+	char *va = diskaddr(blockno);
+	int r;
+
+	mutex_lock(&bc_lock);
+	// A block freed and allocated again may still be in the cache.
+	while (!va_is_mapped(va)) {
+		if (!bc_make_room(1))
+			continue;
+		bc_blocks[bc_stats.bs_resident++] = blockno;
+		break;
+	}
+	if ((r = sys_page_map(0, pg, 0, va, PTE_U|PTE_W|PTE_P)) < 0)
+		panic("in bc_adopt, sys_page_map: %e", r);
+	sys_page_unmap(0, pg);
+	*(volatile char *) va = *(volatile char *) va;	// set PTE_D
+	mutex_unlock(&bc_lock);
+	bc_dirty(va);
+}
+
+// Bring the blocks from blockno to blockno + n into the cache ahead of
+// their use, reading each run of missing ones with a single command.
+// Reads at most half the budget, so as not to push out its own blocks.
+void
+bc_prefetch(uint32_t blockno, uint32_t n)
+{
+	uint32_t i, m;
+
+	mutex_lock(&bc_lock);
+	n = MIN(n, bc_stats.bs_budget / 2);
+	for (i = blockno; i < blockno + n; i += m) {
+		m = 1;
+		if (va_is_mapped(diskaddr(i)))
+			continue;
+		while (i + m < blockno + n && m < MAXRUN
+		       && !va_is_mapped(diskaddr(i + m)))
+			m++;
+		// Others may have read some in while the lock was let go.
+		if (!bc_make_room(m)) {
+			m = 0;
+			continue;
+		}
+		bc_read(i, m);
+		bc_stats.bs_prefetched += m;
+	}
+	mutex_unlock(&bc_lock);
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -31,7 +506,6 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
@@ -49,19 +523,16 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
     addr = ROUNDDOWN(addr, PGSIZE);
-    r = sys_page_alloc(0, addr, PTE_U | PTE_W | PTE_P);
-    if (r < 0) {
-        panic("in bc_pgfault, sys_page_alloc: %e", r);
-    }
-    r = ide_read(blockno * BLKSECTS, addr, BLKSECTS);
-    if (r < 0) {
-        panic("in bc_pgfault, ide_read: %e", r);
+    mutex_lock(&bc_lock);
+    // Another thread may have read it in while we waited, or while
+    // bc_make_room let go of the lock.
+    while (!va_is_mapped(addr)) {
+        if (!bc_make_room(1))
+            continue;
+        bc_read(blockno, 1);
+        bc_stats.bs_misses++;
     }
-
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %e", r);
+    mutex_unlock(&bc_lock);
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
@@ -93,16 +564,47 @@ flush_block(void *addr)
     if (!va_is_dirty(addr)) {
         return;
     }
-    int r = ide_write(blockno * BLKSECTS, addr, BLKSECTS);
-    if (r < 0) {
-        panic("in flush_block, ide_write: %e", r);
-    }
-    r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL);
+    bc_write(blockno, addr, 1);
+    int r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL);
     if (r < 0) {
         panic("in flush_block, sys_page_map: %e", r);
     }
 }
 
+// Write back the dirty blocks among the n from blockno on, each run of
+// consecutive dirty uncompressed ones with a single IDE command, and
+// clear their PTE_D bits.  Pinned blocks are left alone.  Holding
+// bc_lock keeps the CLOCK hand from unmapping a page while the drive
+// is still reading it.
+void
+flush_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t i, m, j;
+	char *va;
+	int r;
+
+	mutex_lock(&bc_lock);
+	for (i = blockno; i < blockno + n; i += m) {
+		m = 1;
+		va = diskaddr(i);
+		if (!va_is_mapped(va) || !va_is_dirty(va) || bc_pinned(i))
+			continue;
+		// Compressed blocks go on their own.
+		while (!bc_zmarked(i) && i + m < blockno + n && m < MAXRUN
+		       && va_is_mapped(va + m * BLKSIZE)
+		       && va_is_dirty(va + m * BLKSIZE) && !bc_pinned(i + m)
+		       && !bc_zmarked(i + m))
+			m++;
+		bc_write(i, va, m);
+		for (j = 0; j < m; j++, va += BLKSIZE) {
+			if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("in flush_run, sys_page_map: %e", r);
+			bc_clean(i + j);
+		}
+	}
+	mutex_unlock(&bc_lock);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -133,12 +635,102 @@ check_bc(void)
 	cprintf("block cache is good\n");
 }
 
+// Test that the block cache keeps to its budget, and that a dirty
+// block survives being evicted.
+static void
+check_bc_evict(void)
+{
+	struct Super backup;
+	struct BcStat st;
+	uint32_t i;
+
+	bc_stat(BCMINBLOCKS, &st);
+	memmove(&backup, diskaddr(1), sizeof backup);
+	strcpy(diskaddr(1), "OOPS!\n");
+
+	// push it out
+	for (i = 2; i < 2 + 2 * BCMINBLOCKS; i++)
+		(void) *(volatile char *) diskaddr(i);
+	bc_stat(BCBUDGET, &st);
+	assert(st.bs_resident <= BCMINBLOCKS);
+	assert(st.bs_evictions > 0);
+	assert(!va_is_mapped(diskaddr(1)));
+
+	// read it back in
+	assert(strcmp(diskaddr(1), "OOPS!\n") == 0);
+
+	// fix it
+	memmove(diskaddr(1), &backup, sizeof backup);
+	flush_block(diskaddr(1));
+
+	cprintf("block cache eviction is good\n");
+}
+
+// Test that bc_prefetch brings in a run of blocks.
+static void
+check_bc_prefetch(void)
+{
+	struct BcStat st;
+	uint32_t i, before;
+
+	for (i = 2; i < 2 + MAXRUN; i++) {
+		assert(!va_is_dirty(diskaddr(i)));
+		sys_page_unmap(0, diskaddr(i));
+	}
+	bc_stat(0, &st);
+	before = st.bs_prefetched;
+
+	bc_prefetch(2, MAXRUN);
+	for (i = 2; i < 2 + MAXRUN; i++)
+		assert(va_is_mapped(diskaddr(i)));
+	bc_stat(0, &st);
+	assert(st.bs_prefetched == before + MAXRUN);
+
+	cprintf("block cache prefetch is good\n");
+}
+
+// Test that a block stored compressed goes out and comes back in fewer
+// sectors than a block, and reads back the same.
+static void
+check_bc_compress(void)
+{
+	struct Super backup;
+	struct BcStat st;
+	uint32_t before;
+
+	memmove(&backup, diskaddr(1), sizeof backup);
+	strcpy(diskaddr(1), "OOPS!\n");
+	bc_zmark(1, 1);
+	bc_stat(0, &st);
+	before = st.bs_sectors;
+	flush_block(diskaddr(1));
+	bc_stat(0, &st);
+	assert(st.bs_sectors - before < BLKSECTS);
+
+	// read it back in
+	sys_page_unmap(0, diskaddr(1));
+	before = st.bs_sectors;
+	assert(strcmp(diskaddr(1), "OOPS!\n") == 0);
+	bc_stat(0, &st);
+	assert(st.bs_sectors - before < BLKSECTS);
+
+	// fix it, stored as it was
+	bc_zmark(1, 0);
+	memmove(diskaddr(1), &backup, sizeof backup);
+	flush_block(diskaddr(1));
+
+	cprintf("block cache compression is good\n");
+}
+
 void
 bc_init(void)
 {
 	struct Super super;
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
+	check_bc_evict();
+	check_bc_prefetch();
+	check_bc_compress();
 
 	// cache the super block by reading it once
 	memmove(&super, diskaddr(1), sizeof super);
@@ -0,0 +1,133 @@
+// The block write queue.  Instead of writing each dirty block as soon
+// as it is flushed, the file system queues it here, and blkq_run writes
+// out the whole batch in one sweep of the disk: sorted by block number,
+// starting from where the last sweep ended (C-LOOK), with each run of
+// adjacent blocks merged into a single IDE command by flush_run.
+// Metadata goes through the journal instead (see blkq_meta).
+
+#include "fs.h"
+
+#define BLKQMAX		128		// queued blocks that force a sweep
+
+// Queued block numbers, kept sorted and without duplicates.
+static uint32_t blkq[BLKQMAX];
+static uint32_t blkq_len;
+// The block after the last one the previous sweep wrote.
+static uint32_t blkq_pos;
+// Metadata blocks changed since the last journal commit.
+static uint32_t blkq_metas[JTXMAX];
+static uint32_t blkq_nmeta;
+static struct Mutex blkq_lock;
+
+// Write the runs of consecutive blocks in blkq[lo..hi).
+static void
+sweep(uint32_t lo, uint32_t hi)
+{
+	uint32_t i, n;
+
+	for (i = lo; i < hi; i += n) {
+		n = 1;
+		while (i + n < hi && blkq[i + n] == blkq[i] + n)
+			n++;
+		flush_run(blkq[i], n);
+		blkq_pos = blkq[i] + n;
+	}
+}
+
+// Dispatch the queue.  Called with blkq_lock held.
+static void
+dispatch(void)
+{
+	uint32_t k;
+
+	for (k = 0; k < blkq_len && blkq[k] < blkq_pos; k++)
+		;
+	sweep(k, blkq_len);
+	sweep(0, k);
+	blkq_len = 0;
+}
+
+// Queue blockno.  Called with blkq_lock held.
+static void
+queue(uint32_t blockno)
+{
+	uint32_t lo, hi, mid;
+
+	lo = 0;
+	hi = blkq_len;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (blkq[mid] < blockno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < blkq_len && blkq[lo] == blockno)
+		return;
+	if (blkq_len == BLKQMAX) {
+		dispatch();
+		lo = 0;
+	}
+	memmove(&blkq[lo + 1], &blkq[lo], (blkq_len - lo) * sizeof(blkq[0]));
+	blkq[lo] = blockno;
+	blkq_len++;
+}
+
+// Write out the queue, then commit the metadata changed since the last
+// commit: data first, so that committed metadata never points at
+// blocks whose contents are not on disk yet.  Called with blkq_lock held.
+static void
+commit(void)
+{
+	uint32_t i;
+
+	dispatch();
+	if (blkq_nmeta == 0)
+		return;
+	journal_commit(blkq_metas, blkq_nmeta);
+	for (i = 0; i < blkq_nmeta; i++)
+		bc_pin(blkq_metas[i], 0);
+	blkq_nmeta = 0;
+}
+
+// Queue block blockno to be written back by the next blkq_run, if it is
+// still dirty then.  A full queue is dispatched first.
+void
+blkq_add(uint32_t blockno)
+{
+	mutex_lock(&blkq_lock);
+	queue(blockno);
+	mutex_unlock(&blkq_lock);
+}
+
+// Note that the metadata block containing va has changed.  With a
+// journal, the block is pinned in the cache until blkq_run commits it
+// along with everything else changed by then (group commit); a
+// transaction that would not fit in the journal is committed early.
+// Without one, the block is just queued.
+void
+blkq_meta(void *va)
+{
+	uint32_t blockno = ((uint32_t) va - DISKMAP) / BLKSIZE;
+
+	bc_dirty(va);
+	mutex_lock(&blkq_lock);
+	if (!journal_enabled())
+		queue(blockno);
+	else if (!bc_pinned(blockno)) {
+		if (blkq_nmeta == journal_room())
+			commit();
+		bc_pin(blockno, 1);
+		blkq_metas[blkq_nmeta++] = blockno;
+	}
+	mutex_unlock(&blkq_lock);
+}
+
+// Write out every queued block and commit the metadata.
+void
+blkq_run(void)
+{
+	mutex_lock(&blkq_lock);
+	commit();
+	mutex_unlock(&blkq_lock);
+}
@@ -17,6 +17,10 @@ check_super(void)
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
 		panic("file system is too large");
 
+	if (super->s_features & ~FS_FEATURES)
+		panic("file system has unknown features %08x",
+		      super->s_features & ~FS_FEATURES);
+
 	cprintf("superblock is good\n");
 }
 
@@ -24,6 +28,16 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+#define BMWORDS		(BLKBITSIZE / 32)	// bitmap words per bitmap block
+#define NBITBLOCKS	(DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+// How many blocks each bitmap block still has free, and the bitmap word
+// where the last allocation left off: alloc_block searches on from
+// there (next fit), skipping full words and full bitmap blocks.
+static uint32_t bm_free[NBITBLOCKS];
+static uint32_t bm_nfree;
+static uint32_t bm_hint;
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -36,6 +50,40 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// Word w of the bitmap, without the bits for blocks past the end of
+// the disk (fsformat leaves those set).
+static uint32_t
+bitmap_word(uint32_t w)
+{
+	uint32_t nblocks = super->s_nblocks;
+
+	if ((w + 1) * 32 > nblocks)
+		return bitmap[w] & ((1 << (nblocks % 32)) - 1);
+	return bitmap[w];
+}
+
+// Count the free blocks under each bitmap block.
+static void
+bitmap_init(void)
+{
+	uint32_t w;
+
+	for (w = 0; w < (super->s_nblocks + 31) / 32; w++)
+		bm_free[w / BMWORDS] += __builtin_popcount(bitmap_word(w));
+	for (w = 0; w < NBITBLOCKS; w++)
+		bm_nfree += bm_free[w];
+}
+
+// Mark the free block blockno in use.
+static void
+take_block(uint32_t blockno)
+{
+	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+	bm_free[blockno / BLKBITSIZE]--;
+	bm_nfree--;
+	blkq_meta(&bitmap[blockno / 32]);
+}
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -43,36 +91,63 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (!block_is_free(blockno)) {
+		bm_free[blockno / BLKBITSIZE]++;
+		bm_nfree++;
+	}
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	blkq_meta(&bitmap[blockno / 32]);
+	bc_zmark(blockno, 0);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Search the bitmap for a free block and allocate it.  The changed
+// bitmap block is queued, to go out to disk with the next flush or
+// sync of the data that uses the block.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	uint32_t nwords = (super->s_nblocks + 31) / 32;
+	uint32_t k, w, word, blockno;
 
-	// LAB 5: Your code here.
-	uint32_t blockno;
-	for (blockno = 0; blockno<=super->s_nblocks; blockno++){
-		if (block_is_free(blockno)){
-			bitmap[blockno / 32] &= ~(1 << (blockno % 32));
-			flush_block((void*)&bitmap[blockno/32]);
+	for (k = 0; k < nwords; k++) {
+		w = (bm_hint + k) % nwords;
+		if (bm_free[w / BMWORDS] == 0) {
+			// Skip the rest of this bitmap block.
+			k += MIN(BMWORDS - w % BMWORDS, nwords - w) - 1;
+			continue;
+		}
+		if ((word = bitmap_word(w)) != 0) {
+			bm_hint = w;
+			// __builtin_ctz compiles to a single bsf.
+			blockno = w * 32 + __builtin_ctz(word);
+			take_block(blockno);
 			return blockno;
 		}
 	}
 	return -E_NO_DISK;
 }
 
+// Allocate up to n free blocks in a row, so that a file can grow by a
+// whole extent: store the first in *start and return how many there
+// are, at least 1.  Returns -E_NO_DISK if we are out of blocks.
+int
+alloc_block_run(uint32_t n, uint32_t *start)
+{
+	uint32_t i;
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	for (i = 1; i < n && block_is_free(r + i); i++)
+		take_block(r + i);
+	bm_hint = (r + i) / 32;
+	*start = r;
+	return i;
+}
+
 // Validate the file system bitmap.
 //
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
@@ -105,28 +180,55 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-       // Find a JOS disk.  Use the second IDE disk (number 1) if availabl
-       if (ide_probe_disk1())
-               ide_set_disk(1);
-       else
-               ide_set_disk(0);
+	// Find a JOS disk, or the set of disks it is striped across.
+	ide_dma_init();
+	stripe_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	journal_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	bitmap_init();
 	
 }
 
+// Point *ptab at the block of block numbers that *slot refers to,
+// allocating a zeroed one if there is none yet and alloc is set.
+// Returns 1 if it allocated one (the caller then journals the block
+// that holds *slot), 0 if there already was one, -E_NOT_FOUND if there
+// is none and alloc is 0, -E_NO_DISK if there is no space for one.
+static int
+table_walk(uint32_t *slot, bool alloc, uint32_t **ptab)
+{
+	int blockno;
+
+	if (*slot == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((blockno = alloc_block()) < 0)
+			return -E_NO_DISK;
+		// set all entries to 0 to hold the invariant
+		memset(diskaddr(blockno), 0, BLKSIZE);
+		blkq_meta(diskaddr(blockno));
+		*slot = blockno;
+		*ptab = diskaddr(blockno);
+		return 1;
+	}
+	*ptab = diskaddr(*slot);
+	return 0;
+}
+
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the blocks that the
+// double-indirect block points to.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -134,42 +236,300 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range
+//		(it's >= NDIRECT + NINDIRECT + NDINDIRECT).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
-       // LAB 5: Your code here.
-	   uint32_t blockno;
-	   int r;
-	   if (NULL==f){
-		   panic("file_block_walk: null pointer");
-	   }
-	   if (filebno>=NDIRECT+NINDIRECT){
-		   return -E_INVAL;
-	   }
-	   if (filebno<NDIRECT){
-		   *ppdiskbno = &(f->f_direct[filebno]);
-		   return 0;
-	   }
-	   if (f->f_indirect == 0){
-		    if (alloc == 0){
-				return -E_NOT_FOUND;
-			}
-		   	//allocate new block
-		    if ((blockno = alloc_block())<0){
+	uint32_t *tab, *slot, bno;
+	int r;
+
+	if (f == NULL)
+		panic("file_block_walk: null pointer");
+	if (filebno < NDIRECT) {
+		*ppdiskbno = &f->f_direct[filebno];
+		return 0;
+	}
+	filebno -= NDIRECT;
+	// struct File is packed, so its fields are walked by way of a copy.
+	if (filebno < NINDIRECT) {
+		bno = f->f_indirect;
+		if ((r = table_walk(&bno, alloc, &tab)) < 0)
+			return r;
+		if (r) {
+			f->f_indirect = bno;
+			blkq_meta(f);
+		}
+		*ppdiskbno = &tab[filebno];
+		return 0;
+	}
+	filebno -= NINDIRECT;
+	if (filebno >= NDINDIRECT)
+		return -E_INVAL;
+	if (!f->f_dindirect && alloc
+	    && !(super->s_features & FS_FEAT_DINDIRECT)) {
+		// The first double-indirect file on an older image.
+		super->s_features |= FS_FEAT_DINDIRECT;
+		blkq_meta(super);
+	}
+	bno = f->f_dindirect;
+	if ((r = table_walk(&bno, alloc, &tab)) < 0)
+		return r;
+	if (r) {
+		f->f_dindirect = bno;
+		blkq_meta(f);
+	}
+	slot = &tab[filebno / NINDIRECT];
+	if ((r = table_walk(slot, alloc, &tab)) < 0)
+		return r;
+	if (r)
+		blkq_meta(slot);
+	*ppdiskbno = &tab[filebno % NINDIRECT];
+	return 0;
+}
+
+static int file_block_lookup(struct File *f, uint32_t filebno, uint32_t *diskbno);
+
+// Tell the block cache that disk block diskbno of f is stored
+// compressed if f is.  Done before the block is read or written, so
+// any block of a compressed file has been marked by the time it is in
+// the cache.
+static void
+file_zmark(struct File *f, uint32_t diskbno)
+{
+	if (f->f_flags & FILE_COMPRESSED)
+		bc_zmark(diskbno, 1);
+}
+
+// Delayed allocation.  file_write does not give new blocks of a file
+// a place on disk right away: their data waits in a page of its own,
+// and only write-back (or flushing the file) allocates disk blocks,
+// for all of the file's waiting blocks at once, so that a file written
+// in small pieces still gets its blocks in long runs.  The pages sit
+// above the journal's in the UTEMP region.  To the block map the
+// blocks are still holes, so file_find_block looks here for them.
+// Only changed under the exclusive fs_lock, so readers need no lock.
+#define DATEMP		((char *) UTEMP + (MAXRUN + JTXMAX + 2) * PGSIZE)
+#define DAMAX		256
+#define DASLACK		16	// free blocks kept back for indirect blocks
+
+struct Delayed {
+	struct File *da_file;	// 0 if the slot is free
+	uint32_t da_filebno;
+};
+
+static struct Delayed datab[DAMAX];
+static uint32_t da_count;
+
+static char *
+da_page(struct Delayed *da)
+{
+	return DATEMP + (da - datab) * PGSIZE;
+}
+
+// The waiting block filebno of f, or NULL.
+static struct Delayed *
+da_find(struct File *f, uint32_t filebno)
+{
+	struct Delayed *da;
+
+	if (da_count == 0)
+		return NULL;
+	for (da = datab; da < datab + DAMAX; da++)
+		if (da->da_file == f && da->da_filebno == filebno)
+			return da;
+	return NULL;
+}
+
+static void
+da_free(struct Delayed *da)
+{
+	sys_page_unmap(0, da_page(da));
+	da->da_file = 0;
+	da_count--;
+}
+
+// Give the waiting blocks of f disk blocks, each run of consecutive
+// ones an extent where the disk has room, and move their pages into the
+// block cache.  The new blocks are queued to be written before the
+// block pointers are committed.
+// Returns 0 on success, -E_NO_DISK if the disk fills up (the blocks
+// that could not be placed keep waiting).
+static int
+file_alloc_delayed(struct File *f)
+{
+	struct Delayed *run[DAMAX], *da;
+	uint32_t *ptr, start, n = 0, i, j, k;
+	int r;
+
+	// Insertion sort f's waiting blocks by file block number.
+	for (da = datab; da < datab + DAMAX; da++) {
+		if (da->da_file != f)
+			continue;
+		for (j = n; j > 0 && run[j - 1]->da_filebno > da->da_filebno; j--)
+			run[j] = run[j - 1];
+		run[j] = da;
+		n++;
+	}
+	for (i = 0; i < n; i += k) {
+		for (k = 1; i + k < n && k < MAXRUN
+		     && run[i + k]->da_filebno == run[i]->da_filebno + k; k++)
+			;
+		if ((r = alloc_block_run(k, &start)) < 0)
+			return r;
+		k = r;
+		for (j = 0; j < k; j++) {
+			if ((r = file_block_walk(f, run[i + j]->da_filebno, &ptr, 1)) < 0) {
+				// No room for an indirect block.
+				for (; j < k; j++)
+					free_block(start + j);
 				return -E_NO_DISK;
 			}
-			// set all entries to 0 to hold the invariant
-			memset(diskaddr(blockno), 0, BLKSIZE);
-			f->f_indirect = blockno;
-	   }
-	   uint32_t* inptr = diskaddr(f->f_indirect);
-	   *ppdiskbno = &inptr[filebno-NDIRECT];
-	   return 0;
+			*ptr = start + j;
+			blkq_meta(ptr);
+			file_zmark(f, start + j);
+			bc_adopt(start + j, da_page(run[i + j]));
+			blkq_add(start + j);
+			run[i + j]->da_file = 0;
+			da_count--;
+		}
+	}
+	return 0;
+}
+
+// Allocate disk blocks for every waiting block.
+static int
+fs_alloc_delayed(void)
+{
+	struct Delayed *da;
+	int r;
+
+	for (da = datab; da_count > 0 && da < datab + DAMAX; da++)
+		if (da->da_file && (r = file_alloc_delayed(da->da_file)) < 0)
+			return r;
+	return 0;
+}
+
+// Set *blk to the page to write block filebno of f in: its cache page
+// if it is on disk, otherwise a waiting page (new ones hold zeros).
+// Returns 0 on success, -E_NO_DISK if the disk has no room left for
+// it, -E_INVAL if filebno is out of range.
+static int
+file_write_block(struct File *f, uint32_t filebno, char **blk)
+{
+	struct Delayed *da;
+	uint32_t diskbno;
+	int r;
+
+	if (f->f_type == FTYPE_DIR || filebno >= NDIRECT + NINDIRECT + NDINDIRECT)
+		return file_get_block(f, filebno, blk);
+	if ((r = file_block_lookup(f, filebno, &diskbno)) < 0)
+		return r;
+	if (diskbno)
+		return file_get_block(f, filebno, blk);
+	if ((da = da_find(f, filebno)) != NULL) {
+		*blk = da_page(da);
+		return 0;
+	}
+	if (da_count == DAMAX && (r = fs_alloc_delayed()) < 0)
+		return r;
+	if (bm_nfree < da_count + DASLACK + 1)
+		return -E_NO_DISK;
+	for (da = datab; da->da_file; da++)
+		;
+	if ((r = sys_page_alloc(0, da_page(da), PTE_U|PTE_W|PTE_P)) < 0)
+		return r;
+	da->da_file = f;
+	da->da_filebno = filebno;
+	da_count++;
+	*blk = da_page(da);
+	return 0;
+}
+
+// The extents of the EXFILES files used most recently: a run of blocks
+// of each that sit in consecutive disk blocks, found by walking the
+// block pointers once, so that going through the file does not take
+// an indirect block lookup (or two) for every block.  Only runs of
+// blocks that are on disk are kept, and blocks only ever leave a file
+// through file_truncate_blocks, which forgets its extent.
+#define EXFILES		16
+#define EXMAXLEN	MAXRUN	// longest extent to look ahead for
+
+struct Extent {
+	struct File *ex_file;
+	uint32_t ex_filebno;	// first file block
+	uint32_t ex_diskbno;	// disk block it is in
+	uint32_t ex_len;	// blocks, 0 if none cached
+};
+
+static struct Extent extab[EXFILES];
+static uint32_t ex_victim;
+static struct Mutex ex_lock;
+
+// Set *diskbno to the disk block of block filebno of f, or 0 if that
+// block is not on disk yet.
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+static int
+file_block_lookup(struct File *f, uint32_t filebno, uint32_t *diskbno)
+{
+	struct Extent *ex;
+	uint32_t *ptr, n;
+	int r;
+
+	mutex_lock(&ex_lock);
+	for (ex = extab; ex < extab + EXFILES; ex++)
+		if (ex->ex_file == f)
+			break;
+	if (ex < extab + EXFILES && filebno >= ex->ex_filebno
+	    && filebno < ex->ex_filebno + ex->ex_len) {
+		*diskbno = ex->ex_diskbno + filebno - ex->ex_filebno;
+		mutex_unlock(&ex_lock);
+		file_zmark(f, *diskbno);
+		return 0;
+	}
+	mutex_unlock(&ex_lock);
 
+	if ((r = file_block_walk(f, filebno, &ptr, false)) == -E_NOT_FOUND
+	    || (r == 0 && *ptr == 0)) {
+		*diskbno = 0;
+		return 0;
+	}
+	if (r < 0)
+		return r;
+	*diskbno = *ptr;
+	file_zmark(f, *diskbno);
+	for (n = 1; n < EXMAXLEN; n++)
+		if (file_block_walk(f, filebno + n, &ptr, false) < 0
+		    || *ptr != *diskbno + n)
+			break;
+
+	mutex_lock(&ex_lock);
+	for (ex = extab; ex < extab + EXFILES; ex++)
+		if (ex->ex_file == f)
+			break;
+	if (ex == extab + EXFILES)
+		ex = &extab[ex_victim++ % EXFILES];
+	ex->ex_file = f;
+	ex->ex_filebno = filebno;
+	ex->ex_diskbno = *diskbno;
+	ex->ex_len = n;
+	mutex_unlock(&ex_lock);
+	return 0;
+}
+
+// Drop the cached extent of f.
+static void
+file_forget_extent(struct File *f)
+{
+	struct Extent *ex;
+
+	mutex_lock(&ex_lock);
+	for (ex = extab; ex < extab + EXFILES; ex++)
+		if (ex->ex_file == f)
+			ex->ex_len = 0;
+	mutex_unlock(&ex_lock);
 }
 
 // Set *blk to the address in memory where the filebno'th
@@ -185,11 +545,19 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
        // LAB 5: Your code here.
 	   int r;
-	   uint32_t newblock;
-	   uint32_t *diskbno;
+	   int newblock;
+	   uint32_t *diskbno, bno;
 	   if (NULL==f){
 		   panic("file_get_block: null pointer");
 	   }
+	   if (file_block_lookup(f, filebno, &bno) == 0 && bno != 0) {
+		   *blk = diskaddr(bno);
+		   bc_lookup(*blk);
+		   return 0;
+	   }
+	   // Give a waiting block its place on disk first.
+	   if (da_find(f, filebno) && (r = file_alloc_delayed(f)) < 0)
+		   return r;
        if ((r = file_block_walk(f, filebno, &diskbno, true))<0){
 		   return r;
 	   }
@@ -200,11 +568,37 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 		   }
 		   //update f->f_indirect  
 		   *diskbno = newblock;
+		   blkq_meta(diskbno);
+		   file_zmark(f, newblock);
+		   blkq_add(newblock);
 	   }
 	   *blk = diskaddr(*diskbno);
+	   bc_lookup(*blk);
 	   return 0;
 }
 
+// Like file_get_block, but never allocates: for a block of f that is
+// not on disk yet, returns -E_NOT_FOUND.  Safe for concurrent readers.
+int
+file_find_block(struct File *f, uint32_t filebno, char **blk)
+{
+	struct Delayed *da;
+	uint32_t diskbno;
+	int r;
+
+	if ((r = file_block_lookup(f, filebno, &diskbno)) < 0)
+		return r;
+	if (diskbno == 0) {
+		if ((da = da_find(f, filebno)) == NULL)
+			return -E_NOT_FOUND;
+		*blk = da_page(da);
+		return 0;
+	}
+	*blk = diskaddr(diskbno);
+	bc_lookup(*blk);
+	return 0;
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -258,6 +652,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 			}
 	}
 	dir->f_size += BLKSIZE;
+	blkq_meta(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
 	f = (struct File*) blk;
@@ -265,6 +660,79 @@ dir_alloc_file(struct File *dir, struct File **file)
 	return 0;
 }
 
+// The directory entry cache: what dir_lookup found for a name in a
+// directory, so that opening a hot path does not scan its directories
+// again.  It keeps misses too (d_file == 0), since programs probe for
+// files that are not there (the shell searching for commands, say).
+// Direct-mapped on a hash of the directory and the name.  Entries only
+// go stale when a file is created under a name that was missed, which
+// file_create takes care of, or when a directory shrinks.
+#define DCSIZE		256
+
+struct Dentry {
+	struct File *d_dir;		// 0 if the slot is unused
+	struct File *d_file;		// 0 for a negative entry
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[DCSIZE];
+static struct Mutex dcache_lock;
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name)
+{
+	uint32_t h = 2166136261u ^ (uint32_t) dir;	// FNV-1a
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619;
+	return &dcache[h % DCSIZE];
+}
+
+// Remember that name in dir is f (or nothing, if f is 0).
+static void
+dcache_enter(struct File *dir, const char *name, struct File *f)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+
+	mutex_lock(&dcache_lock);
+	d->d_dir = dir;
+	d->d_file = f;
+	strcpy(d->d_name, name);
+	mutex_unlock(&dcache_lock);
+}
+
+// Forget every entry; for when a directory loses blocks.
+static void
+dcache_flush(void)
+{
+	mutex_lock(&dcache_lock);
+	memset(dcache, 0, sizeof(dcache));
+	mutex_unlock(&dcache_lock);
+}
+
+// dir_lookup through the cache.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+	int r;
+
+	mutex_lock(&dcache_lock);
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+		*file = d->d_file;
+		mutex_unlock(&dcache_lock);
+		return *file ? 0 : -E_NOT_FOUND;
+	}
+	mutex_unlock(&dcache_lock);
+
+	r = dir_lookup(dir, name, file);
+	if (r == 0)
+		dcache_enter(dir, name, *file);
+	else if (r == -E_NOT_FOUND)
+		dcache_enter(dir, name, 0);
+	return r;
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -312,7 +780,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dcache_lookup(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -351,8 +819,9 @@ file_create(const char *path, struct File **pf)
 		return r;
 
 	strcpy(f->f_name, name);
+	blkq_meta(f);
+	dcache_enter(dir, name, f);
 	*pf = f;
-	file_flush(dir);
 	return 0;
 }
 
@@ -364,6 +833,71 @@ file_open(const char *path, struct File **pf)
 	return walk_path(path, 0, pf, 0);
 }
 
+// Read-ahead state of the RAFILES files read most recently.
+#define RAFILES		16
+#define RAMIN		4	// first read-ahead window, in blocks
+
+struct Readahead {
+	struct File *ra_file;
+	uint32_t ra_next;	// block after the last one read
+	uint32_t ra_window;	// blocks to read ahead, 0 if not sequential
+};
+
+static struct Readahead ratab[RAFILES];
+static uint32_t ra_victim;
+static struct Mutex ra_lock;
+
+// Note that count bytes at offset of f are about to be read.  While f
+// is read sequentially, bring those blocks and the next ra_window ones
+// into the cache, in as few IDE commands as the disk layout allows,
+// doubling the window (up to MAXRUN) on every read that carries on
+// where the last one stopped.
+void
+file_readahead(struct File *f, off_t offset, size_t count)
+{
+	struct Readahead *ra;
+	uint32_t first, last, end, fbno, start = 0, run = 0, diskbno;
+
+	if (count == 0 || offset < 0 || offset >= f->f_size)
+		return;
+	first = offset / BLKSIZE;
+	last = (MIN(offset + count, f->f_size) - 1) / BLKSIZE;
+
+	mutex_lock(&ra_lock);
+	for (ra = ratab; ra < ratab + RAFILES; ra++)
+		if (ra->ra_file == f)
+			break;
+	if (ra == ratab + RAFILES) {
+		ra = &ratab[ra_victim++ % RAFILES];
+		ra->ra_file = f;
+		ra->ra_next = ra->ra_window = 0;
+	}
+	if (first == ra->ra_next)
+		ra->ra_window = ra->ra_window ? MIN(2 * ra->ra_window, MAXRUN) : RAMIN;
+	else if (first + 1 != ra->ra_next)	// not still in the same block
+		ra->ra_window = 0;
+	ra->ra_next = last + 1;
+	end = ra->ra_window ? last + 1 + ra->ra_window : 0;
+	mutex_unlock(&ra_lock);
+
+	// Find runs of consecutive disk blocks, skipping holes.
+	end = MIN(end, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	for (fbno = first; fbno < end; fbno++) {
+		if (file_block_lookup(f, fbno, &diskbno) < 0 || !diskbno)
+			continue;
+		if (run && diskbno == start + run) {
+			run++;
+			continue;
+		}
+		if (run)
+			bc_prefetch(start, run);
+		start = diskbno;
+		run = 1;
+	}
+	if (run)
+		bc_prefetch(start, run);
+}
+
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
 // Returns the number of bytes read, < 0 on error.
@@ -378,12 +912,18 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	file_readahead(f, offset, count);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
-			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
+		// Holes read as zeros; leave them for writes to fill.
+		r = file_find_block(f, pos / BLKSIZE, &blk);
+		if (r == -E_NOT_FOUND)
+			memset(buf, 0, bn);
+		else if (r < 0)
+			return r;
+		else
+			memmove(buf, blk + pos % BLKSIZE, bn);
 		pos += bn;
 		buf += bn;
 	}
@@ -391,6 +931,27 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Find the block cache page holding byte 'offset' of f and fault it in,
+// so that it can be mapped into another environment.  Stores the
+// page in *pblk and returns the number of bytes of file data in it,
+// counting from the start of the block: 0 at or past the end of file.
+// Returns < 0 on error, -E_NOT_FOUND if the block is a hole.
+int
+file_map_block(struct File *f, off_t offset, char **pblk)
+{
+	int r;
+
+	if (offset < 0)
+		return -E_INVAL;
+	if (offset >= f->f_size)
+		return 0;
+	if ((r = file_find_block(f, offset / BLKSIZE, pblk)) < 0)
+		return r;
+	// IPC only passes pages that are present
+	(void) *(volatile char *) *pblk;
+	return MIN(BLKSIZE, f->f_size - ROUNDDOWN(offset, BLKSIZE));
+}
+
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -409,10 +970,12 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 			return r;
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_write_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
+		if (blk < DATEMP || blk >= DATEMP + DAMAX * PGSIZE)
+			bc_dirty(blk);
 		pos += bn;
 		buf += bn;
 	}
@@ -433,6 +996,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		blkq_meta(ptr);
 	}
 	return 0;
 }
@@ -441,68 +1005,153 @@ file_free_block(struct File *f, uint32_t filebno)
 // but not necessary for a file of size 'newsize'.
 // For both the old and new sizes, figure out the number of blocks required,
 // and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// Then free the indirect blocks that no longer point to anything:
+// the indirect block once new_nblocks is no more than NDIRECT, and
+// the blocks under the double-indirect block (and it too) likewise.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
 	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	uint32_t bno, old_nblocks, new_nblocks, i, *dind;
+	struct Delayed *da;
 
+	file_forget_extent(f);
+	if (f->f_type == FTYPE_DIR)
+		dcache_flush();
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
+	for (da = datab; da_count > 0 && da < datab + DAMAX; da++)
+		if (da->da_file == f && da->da_filebno >= new_nblocks)
+			da_free(da);
 
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
+		blkq_meta(f);
+	}
+	if (f->f_dindirect) {
+		dind = diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++) {
+			bno = NDIRECT + NINDIRECT + i * NINDIRECT;
+			if (dind[i] && new_nblocks <= bno) {
+				free_block(dind[i]);
+				dind[i] = 0;
+				blkq_meta(&dind[i]);
+			}
+		}
+		if (new_nblocks <= NDIRECT + NINDIRECT) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+			blkq_meta(f);
+		}
 	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Returns 0 on success, -E_INVAL if newsize is out of range.
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	blkq_meta(f);
+	return 0;
+}
+
+// Store the data blocks of f compressed from now on (see bc_zwrite).
+// Only an empty regular file can be switched, so that no block of it
+// is on disk in the other form.
+// Returns 0 on success, -E_INVAL if f is a directory or not empty.
+int
+file_compress(struct File *f)
+{
+	if (f->f_type == FTYPE_DIR || f->f_size != 0)
+		return -E_INVAL;
+	if (!(super->s_features & FS_FEAT_COMPRESS)) {
+		super->s_features |= FS_FEAT_COMPRESS;
+		blkq_meta(super);
+	}
+	f->f_flags |= FILE_COMPRESSED;
+	blkq_meta(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// and queue it, to be written out if it is dirty.  Then commit:
+// with a journal, the metadata goes out as one transaction, along
+// with every other change made since the last commit.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	int i, r;
+	uint32_t *pdiskbno, *dind;
 
+	if ((r = file_alloc_delayed(f)) < 0)
+		cprintf("warning: file_flush: %e\n", r);
 	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		blkq_add(*pdiskbno);
 	}
-	flush_block(f);
+	blkq_add(((uint32_t) f - DISKMAP) / BLKSIZE);
 	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+		blkq_add(f->f_indirect);
+	if (f->f_dindirect) {
+		blkq_add(f->f_dindirect);
+		dind = diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (dind[i])
+				blkq_add(dind[i]);
+	}
+	blkq_run();
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Write back the blocks that have been dirty for at least age
+// milliseconds, oldest first, and commit the journal with them.
+// Returns -1 if the dirty list lost track of some blocks, 0 otherwise.
+static int
+writeback(uint32_t age)
+{
+	uint32_t blocks[64], since;
+	int i, n;
+
+	if ((n = fs_alloc_delayed()) < 0)
+		cprintf("warning: write-back: %e\n", n);
+	since = sys_time_msec() - age;
+	while ((n = bc_take_dirty(blocks, sizeof(blocks) / sizeof(blocks[0]),
+				   since)) > 0)
+		for (i = 0; i < n; i++)
+			blkq_add(blocks[i]);
+	blkq_run();
+	return n;
+}
+
+// Write back what has been dirty for age milliseconds, for the
+// write-back thread.
+void
+fs_writeback(uint32_t age)
+{
+	if (writeback(age) < 0)
+		flush_run(1, super->s_nblocks - 1);
+}
+
+// Sync the entire file system.  Only looks at the blocks on the dirty
+// list, unless it overflowed.  Committing the journal is enough to make
+// the metadata durable; it is checkpointed later, as usual.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	fs_writeback(0);
 }
 
@@ -3,6 +3,8 @@
 
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
+#define MAXRUN		(256 / BLKSECTS)	// most blocks one IDE command moves
+#define JTXMAX		254			// most blocks in one journal transaction
 
 /* Disk block n, when in memory, is mapped into the file system
  * server's address space at DISKMAP + (n*BLKSIZE). */
@@ -11,38 +13,101 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* How many blocks the block cache holds to begin with.  See bc_stat,
+ * and BCMINBLOCKS and BCMAXBLOCKS in inc/fs.h. */
+#define BCBUDGET	256
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* A transfer between IDE disk ir_disk, from sector ir_secno on, and a
+ * list of buffers: ir_seg[0].is_nsecs sectors at ir_seg[0].is_buf, then
+ * the next segment's, and so on.  See ide_start. */
+#define IDEMAXSEG	8
+
+struct IdeReq {
+	int ir_disk;
+	uint32_t ir_secno;
+	bool ir_write;
+	uint32_t ir_nseg;
+	struct IdeSeg {
+		void *is_buf;
+		uint32_t is_nsecs;
+	} ir_seg[IDEMAXSEG];
+	uint32_t ir_nsecs;		// the rest is for ide.c
+	bool ir_dma;
+	int ir_r;
+};
+
 /* ide.c */
-bool	ide_probe_disk1(void);
-void	ide_set_disk(int diskno);
-void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
-int	ide_read(uint32_t secno, void *dst, size_t nsecs);
-int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+bool	ide_probe(int diskno);
+bool	ide_dma_init(void);
+void	ide_irq_init(void);
+void	ide_start(struct IdeReq *rq);
+int	ide_finish(struct IdeReq *rq);
+int	ide_rw(int diskno, uint32_t secno, void *buf, size_t nsecs, bool write);
+
+/* stripe.c */
+void	stripe_init(void);
+int	disk_read(uint32_t secno, void *dst, size_t nsecs);
+int	disk_write(uint32_t secno, const void *src, size_t nsecs);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	flush_run(uint32_t blockno, uint32_t n);
+void	bc_dirty(void *va);
+int	bc_take_dirty(uint32_t *blocks, int n, uint32_t since);
+uint32_t bc_dirty_count(void);
+void	bc_pin(uint32_t blockno, bool pin);
+bool	bc_pinned(uint32_t blockno);
+void	bc_lookup(void *va);
+void	bc_prefetch(uint32_t blockno, uint32_t n);
+void	bc_adopt(uint32_t blockno, void *pg);
+void	bc_zmark(uint32_t blockno, bool compressed);
+int	bc_stat(uint32_t budget, struct BcStat *st);
 void	bc_init(void);
 
+/* lz.c */
+uint32_t lz_compress(const void *src, uint32_t n, void *dst, uint32_t cap);
+int32_t	lz_decompress(const void *src, uint32_t n, void *dst, uint32_t cap);
+uint32_t lz_checksum(const void *p, uint32_t n);
+
+/* blkq.c */
+void	blkq_add(uint32_t blockno);
+void	blkq_meta(void *va);
+void	blkq_run(void);
+
+/* journal.c */
+void	journal_init(void);
+bool	journal_enabled(void);
+uint32_t journal_room(void);
+void	journal_commit(const uint32_t *blocks, uint32_t n);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_find_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_readahead(struct File *f, off_t offset, size_t count);
+int	file_map_block(struct File *f, off_t offset, char **pblk);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
+int	file_compress(struct File *f);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
+void	fs_writeback(uint32_t age);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+void	free_block(uint32_t blockno);
+int	alloc_block_run(uint32_t n, uint32_t *start);
 
 /* test.c */
 void	fs_test(void);
@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #undef off_t
 #undef bool
 
@@ -30,9 +31,12 @@ typedef int bool;
 
 #include <inc/mmu.h>
 #include <inc/fs.h>
+#include "lz.c"
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
+#define SECTSIZE 512				// SECTSIZE in fs/fs.h
 #define MAX_DIR_ENTS 128
+#define DISKBLOCKS (0xC0000000 / BLKSIZE)	// DISKSIZE in fs/fs.h
 
 struct Dir
 {
@@ -45,6 +49,11 @@ uint32_t nblocks;
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
+int compress;		// -z: store the files' data compressed
+// The images the file system is striped across (-r), with the one
+// named first; just that one if it is not striped.
+const char *stripes[STRIPEMAX];
+int nstripes = 1;
 
 void
 panic(const char *fmt, ...)
@@ -91,20 +100,28 @@ alloc(uint32_t bytes)
 void
 opendisk(const char *name)
 {
-	int r, diskfd, nbitblocks;
-
-	if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
-		panic("open %s: %s", name, strerror(errno));
-
-	if ((r = ftruncate(diskfd, 0)) < 0
-	    || (r = ftruncate(diskfd, nblocks * BLKSIZE)) < 0)
-		panic("truncate %s: %s", name, strerror(errno));
-
-	if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
-			    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
-		panic("mmap %s: %s", name, strerror(errno));
-
-	close(diskfd);
+	int r, diskfd, nbitblocks, jblocks;
+	struct JHeader *jh;
+
+	if (nstripes > 1) {
+		// Put it together in memory; finishdisk deals it out.
+		if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
+				    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			panic("mmap: %s", strerror(errno));
+	} else {
+		if ((diskfd = open(name, O_RDWR | O_CREAT, 0666)) < 0)
+			panic("open %s: %s", name, strerror(errno));
+
+		if ((r = ftruncate(diskfd, 0)) < 0
+		    || (r = ftruncate(diskfd, nblocks * BLKSIZE)) < 0)
+			panic("truncate %s: %s", name, strerror(errno));
+
+		if ((diskmap = mmap(NULL, nblocks * BLKSIZE, PROT_READ|PROT_WRITE,
+				    MAP_SHARED, diskfd, 0)) == MAP_FAILED)
+			panic("mmap %s: %s", name, strerror(errno));
+
+		close(diskfd);
+	}
 
 	diskpos = diskmap;
 	alloc(BLKSIZE);
@@ -117,6 +134,72 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// A journal of 1/32 of the disk, within reason.
+	jblocks = nblocks / 32;
+	if (jblocks >= 16) {
+		if (jblocks > 1024)
+			jblocks = 1024;
+		jh = alloc(jblocks * BLKSIZE);
+		jh->jh_magic = JOURNAL_MAGIC;
+		jh->jh_seq = 1;
+		super->s_journal = blockof(jh);
+		super->s_jblocks = jblocks;
+		super->s_features |= FS_FEAT_JOURNAL;
+	}
+}
+
+void
+writen(int f, const void *in, size_t n, off_t off)
+{
+	ssize_t m;
+
+	for (; n > 0; n -= m, in += m, off += m)
+		if ((m = pwrite(f, in, n, off)) <= 0)
+			panic("write: %s", strerror(errno));
+}
+
+// Deal the image out to the stripes[] images in stripe units of
+// STRIPEUNIT blocks, each image starting with its label (see struct
+// StripeLabel in inc/fs.h).
+void
+writestripes(void)
+{
+	struct StripeLabel sl;
+	uint32_t id = time(NULL) ^ getpid(), unit, rows, row, n;
+	int i, diskfd;
+	char label[BLKSIZE];
+
+	rows = (nblocks + STRIPEUNIT * nstripes - 1) / (STRIPEUNIT * nstripes);
+	for (i = 0; i < nstripes; i++) {
+		if ((diskfd = open(stripes[i], O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+			panic("open %s: %s", stripes[i], strerror(errno));
+		if (ftruncate(diskfd, (1 + rows * STRIPEUNIT) * BLKSIZE) < 0)
+			panic("truncate %s: %s", stripes[i], strerror(errno));
+
+		memset(&sl, 0, sizeof sl);
+		sl.sl_magic = STRIPE_MAGIC;
+		sl.sl_id = id;
+		sl.sl_ndisks = nstripes;
+		sl.sl_index = i;
+		sl.sl_unit = STRIPEUNIT;
+		sl.sl_nblocks = nblocks;
+		memset(label, 0, BLKSIZE);
+		memmove(label, &sl, sizeof sl);
+		writen(diskfd, label, BLKSIZE, 0);
+
+		for (row = 0; row < rows; row++) {
+			unit = row * nstripes + i;
+			if (unit * STRIPEUNIT >= nblocks)
+				break;
+			n = nblocks - unit * STRIPEUNIT;
+			if (n > STRIPEUNIT)
+				n = STRIPEUNIT;
+			writen(diskfd, diskmap + unit * STRIPEUNIT * BLKSIZE,
+			       n * BLKSIZE, (1 + row * STRIPEUNIT) * BLKSIZE);
+		}
+		close(diskfd);
+	}
 }
 
 void
@@ -127,7 +210,9 @@ finishdisk(void)
 	for (i = 0; i < blockof(diskpos); ++i)
 		bitmap[i/32] &= ~(1<<(i%32));
 
-	if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
+	if (nstripes > 1)
+		writestripes();
+	else if ((r = msync(diskmap, nblocks * BLKSIZE, MS_SYNC)) < 0)
 		panic("msync: %s", strerror(errno));
 }
 
@@ -142,9 +227,50 @@ finishfile(struct File *f, uint32_t start, uint32_t len)
 	if (i == NDIRECT) {
 		uint32_t *ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < len / BLKSIZE && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i == NDIRECT + NINDIRECT && i < len / BLKSIZE) {
+		uint32_t *dind = alloc(BLKSIZE), *ind = NULL;
+		f->f_dindirect = blockof(dind);
+		super->s_features |= FS_FEAT_DINDIRECT;
+		for (; i < len / BLKSIZE; ++i) {
+			uint32_t j = i - NDIRECT - NINDIRECT;
+			if (j % NINDIRECT == 0) {
+				ind = alloc(BLKSIZE);
+				dind[j / NINDIRECT] = blockof(ind);
+			}
+			ind[j % NINDIRECT] = start + i;
+		}
+	}
+}
+
+// Store the len bytes of file data at start compressed, block by
+// block, the way the block cache's bc_zwrite does: a struct ZHeader and
+// the compressed data at the start of the block's own place on disk,
+// or the block as it is if compressing would not save a sector.
+void
+compressfile(struct File *f, char *start, uint32_t len)
+{
+	static char buf[BLKSIZE];
+	struct ZHeader *zh = (struct ZHeader *) buf;
+	uint32_t i, n;
+	char *blk;
+
+	f->f_flags |= FILE_COMPRESSED;
+	super->s_features |= FS_FEAT_COMPRESS;
+	for (i = 0; i < len; i += BLKSIZE) {
+		blk = start + i;
+		n = lz_compress(blk, BLKSIZE, zh + 1,
+				BLKSIZE - SECTSIZE - sizeof(*zh));
+		if (n == 0)
+			continue;
+		zh->zh_magic = ZHDR_MAGIC;
+		zh->zh_len = n;
+		zh->zh_sum = lz_checksum(blk, BLKSIZE);
+		memset(blk, 0, BLKSIZE);
+		memmove(blk, buf, sizeof(*zh) + n);
+	}
 }
 
 void
@@ -204,6 +330,8 @@ writefile(struct Dir *dir, const char *name)
 	f = diradd(dir, FTYPE_REG, last);
 	start = alloc(st.st_size);
 	readn(fd, start, st.st_size);
+	if (compress)
+		compressfile(f, start, st.st_size);
 	finishfile(f, blockof(start), st.st_size);
 	close(fd);
 }
@@ -211,7 +339,9 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-z] [-r fs2.img] fs.img NBLOCKS files...\n");
+	fprintf(stderr, "  -z  store the files compressed\n");
+	fprintf(stderr, "  -r  stripe the file system across fs.img and fs2.img\n");
 	exit(2);
 }
 
@@ -224,11 +354,23 @@ main(int argc, char **argv)
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
+	for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+		if (strcmp(argv[1], "-z") == 0)
+			compress = 1;
+		else if (strcmp(argv[1], "-r") == 0 && argc > 2
+			 && nstripes < STRIPEMAX) {
+			stripes[nstripes++] = argv[2];
+			argc--;
+			argv++;
+		} else
+			usage();
+	}
 	if (argc < 3)
 		usage();
+	stripes[0] = argv[1];
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > DISKBLOCKS)
 		usage();
 
 	opendisk(argv[1]);
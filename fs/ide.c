@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code, using bus-master DMA when the controller
+ * supports it and PIO otherwise.  DMA transfers sleep until the disk
+ * interrupts, which the kernel forwards to us (sys_irq_listen).
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,14 +14,66 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
-static int diskno = 1;
+// Bus-master DMA, on PCI IDE controllers that can do it (like the PIIX
+// that QEMU emulates).  The controller walks a table of physical
+// regions (PRDs) by itself, so the drive fills or drains block cache
+// pages while we yield the CPU.  See the Intel PIIX datasheet,
+// "Bus Master IDE Function".
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+#define BM_CMD		0		// bus master registers, from BAR4
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08		//   bus master writes to memory
+#define BM_STATUS	2
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_IRQ	0x04		//   drive raised its interrupt
+#define BM_PRDT		4
+
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+struct Prd {
+	uint32_t prd_addr;		// physical address
+	uint16_t prd_count;		// bytes, 0 meaning 64K
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000		// last entry of the table
+
+// One entry per page of the largest transfer, plus one for each
+// segment that is not page-aligned.
+#define MAXPRD		64
+
+// The two IDE channels, each with up to two drives.  Disk d is drive
+// d % 2 of channel d / 2: disks 0 and 1 are the primary master and
+// slave, 2 and 3 the secondary ones.  The channels work independently,
+// so a transfer on each can be under way at once.
+struct IdeChan {
+	int ic_base;			// command block registers
+	int ic_ctl;			// device control register
+	int ic_irqno;
+	int ic_bm;			// bus master registers, 0 if no DMA
+	bool ic_irq;			// ic_irqno reaches us
+	// Held from ide_start to ide_finish: the file server's threads
+	// take turns at the channel.
+	struct Mutex ic_lock;
+	// Aligned to its size, so it sits within one page.
+	struct Prd ic_prd[MAXPRD] __attribute__((aligned(MAXPRD * sizeof(struct Prd))));
+};
+
+static struct IdeChan ide_chan[2] = {
+	{ 0x1F0, 0x3F6, IRQ_IDE },
+	{ 0x170, 0x376, IRQ_IDE2 },
+};
+
+#define CHAN(disk)	(&ide_chan[(disk) / 2])
 
 static int
-ide_wait_ready(bool check_error)
+ide_wait_ready(struct IdeChan *c, bool check_error)
 {
 	int r;
 
-	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+	while (((r = inb(c->ic_base + 7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
 		/* do nothing */;
 
 	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
@@ -27,86 +81,267 @@ ide_wait_ready(bool check_error)
 	return 0;
 }
 
+// Is there an ATA disk d?  A drive that is not there reads as busy
+// (a floating bus) or not ready, and an ATAPI drive, like the CD-ROM
+// QEMU puts on the secondary channel by default, leaves its signature
+// in the cylinder registers.
 bool
-ide_probe_disk1(void)
+ide_probe(int d)
 {
+	struct IdeChan *c;
 	int r, x;
 
-	// wait for Device 0 to be ready
-	ide_wait_ready(0);
+	if (d < 0 || d > 3)
+		return false;
+	c = CHAN(d);
 
-	// switch to Device 1
-	outb(0x1F6, 0xE0 | (1<<4));
+	// switch to the drive
+	outb(c->ic_base + 6, 0xE0 | ((d&1)<<4));
 
-	// check for Device 1 to be ready for a while
+	// check for it to be ready for a while
 	for (x = 0;
-	     x < 1000 && ((r = inb(0x1F7)) & (IDE_BSY|IDE_DF|IDE_ERR)) != 0;
+	     x < 1000 && ((r = inb(c->ic_base + 7))
+			  & (IDE_BSY|IDE_DRDY|IDE_DF|IDE_ERR)) != IDE_DRDY;
 	     x++)
 		/* do nothing */;
+	if (x < 1000 && inb(c->ic_base + 4) == 0x14 && inb(c->ic_base + 5) == 0xEB)
+		x = 1000;
 
 	// switch back to Device 0
-	outb(0x1F6, 0xE0 | (0<<4));
+	outb(c->ic_base + 6, 0xE0 | (0<<4));
 
-	cprintf("Device 1 presence: %d\n", (x < 1000));
+	cprintf("Device %d presence: %d\n", d, (x < 1000));
 	return (x < 1000);
 }
 
-void
-ide_set_disk(int d)
+// Send the LBA28 command cmd for the sectors of rq to its drive.
+static void
+ide_command(struct IdeReq *rq, int cmd)
 {
-	if (d != 0 && d != 1)
-		panic("bad disk number");
-	diskno = d;
-}
+	struct IdeChan *c = CHAN(rq->ir_disk);
+	uint32_t secno = rq->ir_secno;
 
+	ide_wait_ready(c, 0);
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+	outb(c->ic_base + 2, rq->ir_nsecs);
+	outb(c->ic_base + 3, secno & 0xFF);
+	outb(c->ic_base + 4, (secno >> 8) & 0xFF);
+	outb(c->ic_base + 5, (secno >> 16) & 0xFF);
+	outb(c->ic_base + 6, 0xE0 | ((rq->ir_disk&1)<<4) | ((secno>>24)&0x0F));
+	outb(c->ic_base + 7, cmd);
+}
+
+// Move the sectors of rq by PIO, a sector at a time.
+static int
+ide_pio(struct IdeReq *rq)
 {
+	struct IdeChan *c = CHAN(rq->ir_disk);
+	uint32_t i, n;
+	char *buf;
 	int r;
 
-	assert(nsecs <= 256);
-
-	ide_wait_ready(0);
+	// CMD 0x30 means write sector, 0x20 read sector
+	ide_command(rq, rq->ir_write ? 0x30 : 0x20);
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
-
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		insl(0x1F0, dst, SECTSIZE/4);
+	for (i = 0; i < rq->ir_nseg; i++) {
+		buf = rq->ir_seg[i].is_buf;
+		for (n = rq->ir_seg[i].is_nsecs; n > 0; n--, buf += SECTSIZE) {
+			if ((r = ide_wait_ready(c, 1)) < 0)
+				return r;
+			if (rq->ir_write)
+				outsl(c->ic_base, buf, SECTSIZE/4);
+			else
+				insl(c->ic_base, buf, SECTSIZE/4);
+		}
 	}
 
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+static uint32_t
+pci_conf_read(int dev, int func, int off)
 {
-	int r;
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	return inl(PCI_CONF_DATA);
+}
+
+static void
+pci_conf_write(int dev, int func, int off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	outl(PCI_CONF_DATA, v);
+}
+
+// Look for a bus-master IDE controller on PCI bus 0 and turn on its
+// bus mastering.  Returns true if ide_start will use DMA.
+bool
+ide_dma_init(void)
+{
+	struct IdeChan *c;
+	uint32_t class, bar;
+	int dev, func, i;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			if ((pci_conf_read(dev, func, 0x00) & 0xFFFF) == 0xFFFF)
+				continue;
+			// class 1 (mass storage), subclass 1 (IDE), and
+			// programming interface bit 7: can bus master
+			class = pci_conf_read(dev, func, 0x08);
+			if ((class >> 16) != 0x0101 || !(class & 0x8000))
+				continue;
+			bar = pci_conf_read(dev, func, 0x20);
+			if (!(bar & 1))		// must be I/O space
+				continue;
+			// enable I/O space and bus mastering
+			pci_conf_write(dev, func, 0x04,
+				       pci_conf_read(dev, func, 0x04) | 0x5);
+			for (i = 0; i < 2; i++) {
+				c = &ide_chan[i];
+				// the secondary's registers follow the primary's
+				c->ic_bm = (bar & 0xFFFC) + 8 * i;
+				// have the drives interrupt (clear nIEN); the
+				// interrupts reach us once ide_irq_init runs
+				outb(c->ic_ctl, 0);
+			}
+			cprintf("IDE bus-master DMA at port 0x%x\n", bar & 0xFFFC);
+			return true;
+		}
+	return false;
+}
+
+// Have the kernel pass the disks' interrupts on to us, so that a thread
+// waiting for a DMA transfer sleeps rather than polls.  Until then, in
+// fs_init, transfers poll: the waiting thread receives IPC, and there
+// the main thread, which clients send their requests to, would take a
+// request for an interrupt and lose it.  serve calls this once the
+// worker threads that do the transfers from then on are running.
+void
+ide_irq_init(void)
+{
+	struct IdeChan *c;
+
+	for (c = ide_chan; c < ide_chan + 2; c++)
+		if (c->ic_bm)
+			c->ic_irq = sys_irq_listen(c->ic_irqno) == 0;
+}
 
-	assert(nsecs <= 256);
+// Start moving the sectors of rq by DMA.
+// Returns 0 on success, -E_INVAL if part of a buffer is not mapped (the
+// caller then falls back to PIO, which can fault it in).
+static int
+ide_dma_start(struct IdeReq *rq)
+{
+	struct IdeChan *c = CHAN(rq->ir_disk);
+	uintptr_t va, end, next;
+	uint32_t i;
+	int n = 0;
+
+	for (i = 0; i < rq->ir_nseg; i++) {
+		va = (uintptr_t) rq->ir_seg[i].is_buf;
+		end = va + rq->ir_seg[i].is_nsecs * SECTSIZE;
+		for (; va < end; n++, va = next) {
+			if (!va_is_mapped((void *) va))
+				return -E_INVAL;
+			assert(n < MAXPRD);
+			next = MIN(ROUNDDOWN(va, PGSIZE) + PGSIZE, end);
+			c->ic_prd[n].prd_addr = PTE_ADDR(uvpt[PGNUM(va)]) | PGOFF(va);
+			c->ic_prd[n].prd_count = next - va;
+			c->ic_prd[n].prd_flags = 0;
+		}
+	}
+	c->ic_prd[n - 1].prd_flags = PRD_EOT;
 
-	ide_wait_ready(0);
+	// Direct the interrupt to this thread, dropping any stale one.
+	if (c->ic_irq)
+		sys_irq_listen(c->ic_irqno);
+	outl(c->ic_bm + BM_PRDT, PTE_ADDR(uvpt[PGNUM(c->ic_prd)]) | PGOFF(c->ic_prd));
+	outb(c->ic_bm + BM_CMD, rq->ir_write ? 0 : BM_CMD_READ);
+	outb(c->ic_bm + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);	// clear
+	ide_command(rq, rq->ir_write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+	outb(c->ic_bm + BM_CMD, (rq->ir_write ? 0 : BM_CMD_READ) | BM_CMD_START);
+	return 0;
+}
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+// Wait for the DMA transfer of rq to finish.
+// Returns 0 on success, -1 on a disk error.
+static int
+ide_dma_finish(struct IdeReq *rq)
+{
+	struct IdeChan *c = CHAN(rq->ir_disk);
+	int st;
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		outsl(0x1F0, src, SECTSIZE/4);
+	// The drive interrupts when the command is done.  Sleep until
+	// then, or at least let others run.  A notification is the IPC
+	// value of an IDE IRQ from envid 0; once ide_irq_init has run,
+	// only the worker and write-back threads do transfers, and
+	// clients never send to them.  It may be for the other channel,
+	// if this thread has a transfer under way there too, so look at
+	// the status again.
+	while (!((st = inb(c->ic_bm + BM_STATUS)) & (BM_STATUS_ERR | BM_STATUS_IRQ))) {
+		if (c->ic_irq)
+			ipc_recv(NULL, NULL, NULL);
+		else
+			sys_yield();
 	}
+	outb(c->ic_bm + BM_CMD, 0);
 
+	// Reading the status also acknowledges the drive's interrupt.
+	if ((st & BM_STATUS_ERR) || ide_wait_ready(c, 1) < 0)
+		return -1;
 	return 0;
 }
 
+// Start the transfer rq: by DMA if we can, in which case it goes on
+// while the caller does other things, such as start a transfer on the
+// other channel, else by PIO, all of it at once.  The caller must
+// then call ide_finish(rq), and not start another transfer on the
+// same channel before that.
+void
+ide_start(struct IdeReq *rq)
+{
+	struct IdeChan *c = CHAN(rq->ir_disk);
+	uint32_t i;
+
+	for (rq->ir_nsecs = i = 0; i < rq->ir_nseg; i++)
+		rq->ir_nsecs += rq->ir_seg[i].is_nsecs;
+	assert(rq->ir_nseg > 0 && rq->ir_nsecs <= 256);
+
+	mutex_lock(&c->ic_lock);
+	rq->ir_dma = c->ic_bm && ide_dma_start(rq) == 0;
+	if (!rq->ir_dma)
+		rq->ir_r = ide_pio(rq);
+}
+
+// Wait for the transfer rq to finish.  If DMA fails, give up on it for
+// good on that channel, and move the sectors by PIO.
+// Returns 0 on success, -1 on a disk error.
+int
+ide_finish(struct IdeReq *rq)
+{
+	struct IdeChan *c = CHAN(rq->ir_disk);
+
+	if (rq->ir_dma && (rq->ir_r = ide_dma_finish(rq)) < 0) {
+		cprintf("IDE DMA error, falling back to PIO\n");
+		c->ic_bm = 0;
+		rq->ir_r = ide_pio(rq);
+	}
+	mutex_unlock(&c->ic_lock);
+	return rq->ir_r;
+}
+
+// Move nsecs sectors between disk d, from secno on, and buf.
+int
+ide_rw(int d, uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	struct IdeReq rq;
+
+	rq.ir_disk = d;
+	rq.ir_secno = secno;
+	rq.ir_write = write;
+	rq.ir_nseg = 1;
+	rq.ir_seg[0].is_buf = buf;
+	rq.ir_seg[0].is_nsecs = nsecs;
+	ide_start(&rq);
+	return ide_finish(&rq);
+}
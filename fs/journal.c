@@ -0,0 +1,286 @@
+// The metadata journal.  blkq_run commits the metadata blocks changed
+// since the last commit (bitmap, indirect and directory blocks, the
+// superblock) as one transaction, written to the journal in a single
+// sequential run: a descriptor block naming the blocks, their contents,
+// and a commit block whose checksum covers all of it, so that recovery
+// can tell a transaction cut short by a crash and ignore it.
+//
+// The blocks themselves stay dirty in the cache and reach their place
+// on disk later (checkpointing): when the cache writes them back, or
+// when the journal runs out of room for the next transaction.  Then
+// every block still only in the journal is written in place and the
+// header's sequence number moves past the old transactions.  At mount,
+// journal_init replays the live transactions that committed.
+
+#include "fs.h"
+
+// Transactions are put together here: the descriptor, the cache pages
+// of the blocks mapped in after it, and the commit block.  Just above
+// the pages bc_read uses.
+#define JTEMP		((char *) UTEMP + MAXRUN * PGSIZE)
+#define JMAXBLOCKS	1024		// largest journal we use all of
+
+// A block that a committed transaction logged but that may not be in
+// place yet, and the journal block holding its latest contents.
+struct Checkpoint {
+	uint32_t ck_blockno;
+	uint32_t ck_jblock;
+};
+
+static bool j_enabled;
+static uint32_t j_header;		// the header block
+static uint32_t j_end;			// the block after the journal
+static uint32_t j_head;			// where the next transaction goes
+static uint32_t j_seq;			// and its sequence number
+// Sorted by ck_blockno, without duplicates.
+static struct Checkpoint j_ckpt[JMAXBLOCKS];
+static uint32_t j_nckpt;
+static struct Mutex j_lock;
+
+bool
+journal_enabled(void)
+{
+	return j_enabled;
+}
+
+// The most blocks one transaction can log.
+uint32_t
+journal_room(void)
+{
+	return MIN(JTXMAX, j_end - j_header - 3);
+}
+
+static uint32_t
+checksum(uint32_t sum, const void *blk)
+{
+	const uint32_t *w = blk;
+	int i;
+
+	for (i = 0; i < BLKSIZE / 4; i++)
+		sum = (sum ^ w[i]) * 16777619;	// FNV-1a, a word at a time
+	return sum;
+}
+
+static void
+jtemp_alloc(uint32_t i, uint32_t n)
+{
+	int r;
+
+	for (; n > 0; i++, n--)
+		if ((r = sys_page_alloc(0, JTEMP + i * PGSIZE, PTE_U|PTE_W|PTE_P)) < 0)
+			panic("journal: sys_page_alloc: %e", r);
+}
+
+static void
+jtemp_free(uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		sys_page_unmap(0, JTEMP + i * PGSIZE);
+}
+
+// Move the n blocks at JTEMP to or from the disk from blockno on.
+static void
+jtemp_io(uint32_t blockno, uint32_t n, bool write)
+{
+	uint32_t i, m;
+	int r;
+
+	for (i = 0; i < n; i += m) {
+		m = MIN(MAXRUN, n - i);
+		if (write)
+			r = disk_write((blockno + i) * BLKSECTS, JTEMP + i * PGSIZE,
+				       m * BLKSECTS);
+		else
+			r = disk_read((blockno + i) * BLKSECTS, JTEMP + i * PGSIZE,
+				      m * BLKSECTS);
+		if (r < 0)
+			panic("journal: disk_%s: %e", write ? "write" : "read", r);
+	}
+}
+
+// Start the journal over at sequence number j_seq.
+static void
+write_header(void)
+{
+	struct JHeader *jh = (struct JHeader *) JTEMP;
+
+	jtemp_alloc(0, 1);
+	jh->jh_magic = JOURNAL_MAGIC;
+	jh->jh_seq = j_seq;
+	jtemp_io(j_header, 1, true);
+	jtemp_free(1);
+	j_head = j_header + 1;
+}
+
+// Note that the latest contents of blockno are in journal block jblock.
+static void
+ckpt_add(uint32_t blockno, uint32_t jblock)
+{
+	uint32_t lo = 0, hi = j_nckpt, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (j_ckpt[mid].ck_blockno < blockno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == j_nckpt || j_ckpt[lo].ck_blockno != blockno) {
+		memmove(&j_ckpt[lo + 1], &j_ckpt[lo],
+			(j_nckpt - lo) * sizeof(j_ckpt[0]));
+		j_nckpt++;
+	}
+	j_ckpt[lo].ck_blockno = blockno;
+	j_ckpt[lo].ck_jblock = jblock;
+}
+
+// Put every logged block in place, then empty the journal.  A block that
+// has been changed again since is pinned, and its committed contents
+// are only in the journal, so it is copied from there.  Called with
+// j_lock held.
+static void
+checkpoint(void)
+{
+	uint32_t i, n;
+
+	for (i = 0; i < j_nckpt; i += n) {
+		n = 1;
+		if (bc_pinned(j_ckpt[i].ck_blockno)) {
+			jtemp_alloc(0, 1);
+			jtemp_io(j_ckpt[i].ck_jblock, 1, false);
+			jtemp_io(j_ckpt[i].ck_blockno, 1, true);
+			jtemp_free(1);
+			continue;
+		}
+		while (i + n < j_nckpt
+		       && j_ckpt[i + n].ck_blockno == j_ckpt[i].ck_blockno + n
+		       && !bc_pinned(j_ckpt[i + n].ck_blockno))
+			n++;
+		flush_run(j_ckpt[i].ck_blockno, n);
+	}
+	j_nckpt = 0;
+	write_header();
+}
+
+// Log the n blocks as one transaction and commit it.  The blocks must
+// be pinned, so that none of them has been written in place.
+void
+journal_commit(const uint32_t *blocks, uint32_t n)
+{
+	struct JDesc *jd = (struct JDesc *) JTEMP;
+	struct JCommit *jc = (struct JCommit *) (JTEMP + (n + 1) * PGSIZE);
+	uint32_t i, sum;
+	char *va;
+	int r;
+
+	assert(n > 0 && n <= journal_room());
+	mutex_lock(&j_lock);
+	if (j_head + n + 2 > j_end)
+		checkpoint();
+
+	jtemp_alloc(0, 1);
+	memset(jd, 0, BLKSIZE);
+	jd->jd_magic = JDESC_MAGIC;
+	jd->jd_seq = j_seq;
+	jd->jd_n = n;
+	memmove(jd->jd_blocks, blocks, n * sizeof(blocks[0]));
+	sum = checksum(2166136261u, jd);
+	// Log the cache pages themselves rather than copies.
+	for (i = 0; i < n; i++) {
+		va = diskaddr(blocks[i]);
+		(void) *(volatile char *) va;
+		if ((r = sys_page_map(0, va, 0, JTEMP + (i + 1) * PGSIZE,
+				      PTE_U|PTE_P)) < 0)
+			panic("journal: sys_page_map: %e", r);
+		sum = checksum(sum, va);
+	}
+	jtemp_alloc(n + 1, 1);
+	memset(jc, 0, BLKSIZE);
+	jc->jc_magic = JCOMMIT_MAGIC;
+	jc->jc_seq = j_seq;
+	jc->jc_sum = sum;
+
+	jtemp_io(j_head, n + 2, true);
+	jtemp_free(n + 2);
+	for (i = 0; i < n; i++)
+		ckpt_add(blocks[i], j_head + 1 + i);
+	j_head += n + 2;
+	j_seq++;
+	mutex_unlock(&j_lock);
+}
+
+// Read the transaction at j_head into JTEMP, descriptor first, and
+// return how many blocks it logs, or -1 if there is no committed
+// transaction with sequence number j_seq there.
+static int
+read_transaction(void)
+{
+	struct JDesc *jd = (struct JDesc *) JTEMP;
+	struct JCommit *jc;
+	uint32_t i, n, sum;
+
+	if (j_head + 2 > j_end)
+		return -1;
+	jtemp_alloc(0, 1);
+	jtemp_io(j_head, 1, false);
+	n = jd->jd_n;
+	if (jd->jd_magic != JDESC_MAGIC || jd->jd_seq != j_seq
+	    || n == 0 || n > JTXMAX || j_head + n + 2 > j_end) {
+		jtemp_free(1);
+		return -1;
+	}
+	jtemp_alloc(1, n + 1);
+	jtemp_io(j_head + 1, n + 1, false);
+	jc = (struct JCommit *) (JTEMP + (n + 1) * PGSIZE);
+	sum = checksum(2166136261u, jd);
+	for (i = 0; i < n; i++)
+		sum = checksum(sum, JTEMP + (i + 1) * PGSIZE);
+	if (jc->jc_magic != JCOMMIT_MAGIC || jc->jc_seq != j_seq
+	    || jc->jc_sum != sum) {
+		jtemp_free(n + 2);
+		return -1;
+	}
+	return n;
+}
+
+// Find the journal, if the file system has one, and replay the
+// transactions committed since the last checkpoint.
+void
+journal_init(void)
+{
+	struct JDesc *jd = (struct JDesc *) JTEMP;
+	struct JHeader *jh = (struct JHeader *) JTEMP;
+	uint32_t i, ntx = 0;
+	int n;
+
+	if (!(super->s_features & FS_FEAT_JOURNAL))
+		return;
+	j_header = super->s_journal;
+	j_end = j_header + MIN(super->s_jblocks, JMAXBLOCKS);
+	if (j_header < 2 || j_end > super->s_nblocks || j_end < j_header + 4)
+		panic("bad journal at %d, %d blocks", j_header, super->s_jblocks);
+
+	jtemp_alloc(0, 1);
+	jtemp_io(j_header, 1, false);
+	if (jh->jh_magic != JOURNAL_MAGIC)
+		panic("bad journal magic number");
+	j_seq = jh->jh_seq;
+	jtemp_free(1);
+
+	for (j_head = j_header + 1; (n = read_transaction()) >= 0; ntx++) {
+		for (i = 0; i < n; i++)
+			memmove(diskaddr(jd->jd_blocks[i]),
+				JTEMP + (i + 1) * PGSIZE, BLKSIZE);
+		jtemp_free(n + 2);
+		j_head += n + 2;
+		j_seq++;
+	}
+	if (ntx) {
+		flush_run(1, super->s_nblocks - 1);
+		cprintf("journal: replayed %d transactions\n", ntx);
+	}
+	write_header();
+	j_enabled = 1;
+}
@@ -0,0 +1,178 @@
+// A small LZ77 compressor for file blocks, after LZ4.  The compressed
+// data is a series of sequences, each made of
+//	a token byte: the high 4 bits are the number of literals, the
+//		low 4 bits the match length less LZ_MINMATCH, and 15 in
+//		either means that more bytes follow to add to it, each
+//		0-255, up to the first that is not 255;
+//	the literal count's extra bytes, then the literals;
+//	the match's distance back, 2 bytes little-endian, then the match
+//		length's extra bytes.
+// The last sequence stops after its literals, and ends the data.
+//
+// fsformat includes this file too, so it keeps to inc/types.h.
+
+#include <inc/types.h>
+
+#define LZ_MINMATCH	4
+#define LZ_MAXDIST	0xFFFF
+#define LZ_HASHBITS	12
+
+// Where each hash of 4 bytes was last seen, plus one; 0 for never.
+// The block cache only compresses with bc_lock held.
+static uint16_t lz_tab[1 << LZ_HASHBITS];
+
+static uint32_t
+lz_read32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint32_t
+lz_hash(const uint8_t *p)
+{
+	return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+// Store len, whose first 15 went in the token, at op.
+static uint8_t *
+lz_putlen(uint8_t *op, uint32_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+// Add a sequence of nlit literals from lit and a match of mlen bytes
+// dist back (none if mlen is 0) at op.  Returns where it ends, or NULL
+// if it would not fit before oend.
+static uint8_t *
+lz_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, uint32_t nlit,
+	    uint32_t dist, uint32_t mlen)
+{
+	uint32_t need, i;
+	uint8_t *token;
+
+	need = 1 + nlit + (nlit >= 15 ? 1 + (nlit - 15) / 255 : 0);
+	if (mlen)
+		need += 2 + (mlen - LZ_MINMATCH >= 15
+			     ? 1 + (mlen - LZ_MINMATCH - 15) / 255 : 0);
+	if (need > (uint32_t) (oend - op))
+		return NULL;
+
+	token = op++;
+	*token = (nlit >= 15 ? 15 : nlit) << 4;
+	if (nlit >= 15)
+		op = lz_putlen(op, nlit);
+	for (i = 0; i < nlit; i++)
+		*op++ = lit[i];
+	if (mlen) {
+		*op++ = dist & 0xFF;
+		*op++ = dist >> 8;
+		mlen -= LZ_MINMATCH;
+		*token |= mlen >= 15 ? 15 : mlen;
+		if (mlen >= 15)
+			op = lz_putlen(op, mlen);
+	}
+	return op;
+}
+
+// Compress the n bytes at src (n < 65535) into at most cap bytes at dst.
+// Returns the compressed size, or 0 if it does not fit.
+uint32_t
+lz_compress(const void *src, uint32_t n, void *dst, uint32_t cap)
+{
+	const uint8_t *in = src, *ip = in, *anchor = in, *iend = in + n;
+	const uint8_t *ref;
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t h, len, i;
+
+	for (i = 0; i < sizeof(lz_tab) / sizeof(lz_tab[0]); i++)
+		lz_tab[i] = 0;
+	while (iend - ip >= LZ_MINMATCH) {
+		h = lz_hash(ip);
+		ref = lz_tab[h] ? in + lz_tab[h] - 1 : NULL;
+		lz_tab[h] = ip - in + 1;
+		if (!ref || ip - ref > LZ_MAXDIST
+		    || lz_read32(ref) != lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+		for (len = LZ_MINMATCH; ip + len < iend && ref[len] == ip[len]; len++)
+			;
+		if (!(op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, len)))
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+	if (!(op = lz_sequence(op, oend, anchor, iend - anchor, 0, 0)))
+		return 0;
+	return op - (uint8_t *) dst;
+}
+
+// Read a length whose first 15 came from the token.  Returns -1 if the
+// data runs out.
+static int32_t
+lz_getlen(const uint8_t **ip, const uint8_t *iend, uint32_t len)
+{
+	uint8_t b;
+
+	if (len < 15)
+		return len;
+	do {
+		if (*ip == iend)
+			return -1;
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+// Decompress the n bytes at src into at most cap bytes at dst.
+// Returns the decompressed size, or -1 if the data is not well formed
+// or does not fit.
+int32_t
+lz_decompress(const void *src, uint32_t n, void *dst, uint32_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *out = dst, *op = out, *oend = out + cap;
+	int32_t nlit, mlen;
+	uint32_t dist, i;
+	uint8_t token;
+
+	while (ip < iend) {
+		token = *ip++;
+		if ((nlit = lz_getlen(&ip, iend, token >> 4)) < 0
+		    || nlit > iend - ip || nlit > oend - op)
+			return -1;
+		for (i = 0; i < (uint32_t) nlit; i++)
+			*op++ = *ip++;
+		if (ip == iend)
+			break;		// the last sequence
+		if (iend - ip < 2)
+			return -1;
+		dist = ip[0] | ip[1] << 8;
+		ip += 2;
+		if ((mlen = lz_getlen(&ip, iend, token & 15)) < 0)
+			return -1;
+		mlen += LZ_MINMATCH;
+		if (dist == 0 || dist > (uint32_t) (op - out) || mlen > oend - op)
+			return -1;
+		// byte by byte: the match may overlap what it produces
+		for (i = 0; i < (uint32_t) mlen; i++, op++)
+			*op = op[-(int32_t) dist];
+	}
+	return op - out;
+}
+
+// FNV-1a hash of the n bytes at p (n a multiple of 4), a word at a time.
+uint32_t
+lz_checksum(const void *p, uint32_t n)
+{
+	const uint32_t *w = p;
+	uint32_t sum = 2166136261u, i;
+
+	for (i = 0; i < n / 4; i++)
+		sum = (sum ^ w[i]) * 16777619;
+	return sum;
+}
@@ -28,12 +28,22 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// Free entries are kept on a list, so opening a file does not have to
+// look through the table.  An entry goes back on it when its client
+// closes it with FSREQ_CLOSE, or, for a client that exited or never
+// said so, when openfile_sweep finds that the server holds the only
+// reference to its Fd page.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
-	struct File *o_file;	// mapped descriptor for open file
+	struct File *o_file;	// mapped descriptor for open file,
+				// NULL if the entry is free
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	int o_next;		// next free entry, -1 at the end
+	struct Mutex o_seek_lock;	// held by a read from taking the
+					// seek position to advancing it
 };
 
 // Max number of open files in the file system at once
@@ -44,43 +54,170 @@ struct OpenFile {
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
+int opentab_free;
+
+// Requests are served by NWORKERS threads, so that a request that
+// has to wait for the disk does not hold up the others.  The initial
+// thread receives each request straight into the region of an idle
+// worker and hands it over.
+//
+// Readers of the file system (read, stat, map, readdir) share fs_lock,
+// anything that changes it takes fs_lock exclusively.
+#define NWORKERS	4
+
+struct Worker {
+	uthread_t w_tid;
+	union Fsipc *w_req;	// where its requests arrive: the request
+				// page, then any data pages of a write
+	char *w_readva;		// where serve_read lines up the block
+				// pages it sends back
+	uint32_t w_type;	// the current request
+	envid_t w_whom;
+	int w_npages;		// pages received with it
+	bool w_busy;
+	struct Semaphore w_go;	// posted when a request is handed over
+};
+
+struct Worker workers[NWORKERS];
+struct Mutex workers_lock;
+struct Semaphore workers_idle;
+
+struct RWLock fs_lock;
+
+// Each worker's region is 2 * FSMAXPAGES pages below the block cache.
+#define WORKVA(i)	(DISKMAP - ((i) + 1) * 2 * FSMAXPAGES * PGSIZE)
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Asynchronous request rings shared with clients, FSMAXPAGES pages
+// each: the struct Fsring, then its data pages.
+#define MAXRINGS	8
+#define RINGVA		(WORKVA(NWORKERS - 1) - MAXRINGS * FSMAXPAGES * PGSIZE)
+
+struct RingClient {
+	envid_t rc_envid;	// client, 0 if the slot is free
+	struct Fsring *rc_ring;
+	struct Mutex rc_lock;	// held while serving the ring
+};
+
+struct RingClient ringtab[MAXRINGS];
+struct Mutex ringtab_lock;
+
+// A page of zeros, sent for holes in files.
+#define ZEROPAGE	(RINGVA - PGSIZE)
+// The file version page.
+#define VERSPAGE	(ZEROPAGE - PGSIZE)
+#define fs_versions	((volatile uint32_t *) VERSPAGE)
+
+// The write-back thread wakes up every WBPERIOD milliseconds and writes
+// back the blocks that have been dirty for WBAGE, committing the
+// journal with them.  When more than WBHIGH blocks are dirty, workers
+// wake it early, and it writes back all of them.  Each time round it
+// also frees the open files of clients that have gone.
+#define WBPERIOD	1000
+#define WBAGE		3000
+#define WBHIGH		(BCBUDGET / 4)
+
+uthread_t wb_tid;
+volatile uint32_t wb_kick;
+
+// Have the write-back thread write back everything now.
+static void
+writeback_kick(void)
+{
+	if (!wb_kick) {
+		wb_kick = 1;
+		sys_futex_wake(&wb_kick, 1);
+	}
+}
+
+// Return the worker the calling thread is, or NULL for the initial
+// thread.
+static struct Worker *
+worker_self(void)
+{
+	uthread_t self = uthread_self();
+	int i;
+
+	for (i = 0; i < NWORKERS; i++)
+		if (workers[i].w_tid == self)
+			return &workers[i];
+	return NULL;
+}
 
 void
 serve_init(void)
 {
-	int i;
+	int i, r;
 	uintptr_t va = FILEVA;
 	for (i = 0; i < MAXOPEN; i++) {
 		opentab[i].o_fileid = i;
 		opentab[i].o_fd = (struct Fd*) va;
+		opentab[i].o_next = i + 1 < MAXOPEN ? i + 1 : -1;
 		va += PGSIZE;
 	}
+	opentab_free = 0;
+	if ((r = sys_page_alloc(0, (void *) ZEROPAGE, PTE_P|PTE_U)) < 0)
+		panic("serve_init: %e", r);
+	if ((r = sys_page_alloc(0, (void *) VERSPAGE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("serve_init: %e", r);
+}
+
+// f's counter in the file version page.
+static uint32_t
+file_vslot(struct File *f)
+{
+	return ((uintptr_t) f - DISKMAP) / sizeof(struct File) % FSNVERS;
+}
+
+// Note that f's contents or size changed, so that clients drop what
+// they buffered of it.
+static void
+file_changed(struct File *f)
+{
+	fs_versions[file_vslot(f)]++;
+}
+
+// Put open file o back on the free list.
+static void
+openfile_free(struct OpenFile *o)
+{
+	o->o_file = NULL;
+	o->o_next = opentab_free;
+	opentab_free = o - opentab;
 }
 
-// Allocate an open file.
+// Free the open files whose clients are all gone, leaving the server
+// with the only reference to the Fd page.  Returns how many it freed.
+// Called with fs_lock held exclusively.
 int
-openfile_alloc(struct OpenFile **o)
+openfile_sweep(void)
 {
-	int i, r;
+	int i, n = 0;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file && pageref(opentab[i].o_fd) == 1) {
+			openfile_free(&opentab[i]);
+			n++;
 		}
-	}
-	return -E_MAX_OPEN;
+	return n;
+}
+
+// Allocate an open file.  Called with fs_lock held exclusively.
+int
+openfile_alloc(struct OpenFile **o)
+{
+	int r;
+
+	if (opentab_free < 0 && openfile_sweep() == 0)
+		return -E_MAX_OPEN;
+	*o = &opentab[opentab_free];
+	// A closed entry's Fd page went with its last client.
+	if (pageref((*o)->o_fd) == 0
+	    && (r = sys_page_alloc(0, (*o)->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	opentab_free = (*o)->o_next;
+	(*o)->o_fileid += MAXOPEN;
+	memset((*o)->o_fd, 0, PGSIZE);
+	return (*o)->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -131,14 +268,14 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %e", r);
-			return r;
+			goto fail;
 		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
 
@@ -147,20 +284,27 @@ try_open:
 		if ((r = file_set_size(f, 0)) < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
-			return r;
+			goto fail;
 		}
+		file_changed(f);
 	}
 	if ((r = file_open(path, &f)) < 0) {
 		if (debug)
 			cprintf("file_open failed: %e", r);
-		return r;
+		goto fail;
 	}
 
+	// An existing file that is not empty keeps the form it is in.
+	if ((req->req_omode & O_COMPRESS) && f->f_type == FTYPE_REG
+	    && f->f_size == 0)
+		file_compress(f);
+
 	// Save the file pointer
 	o->o_file = f;
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.vslot = file_vslot(f);
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
@@ -174,6 +318,10 @@ try_open:
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 
 	return 0;
+
+fail:
+	openfile_free(o);
+	return r;
 }
 
 // Set the size of req->req_fileid to req->req_size bytes, truncating
@@ -197,34 +345,104 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	if ((r = file_set_size(o->o_file, req->req_size)) < 0)
+		return r;
+	file_changed(o->o_file);
+	return 0;
 }
 
-// Read at most ipc->read.req_n bytes from the current seek position
-// in ipc->read.req_fileid.  Return the bytes read from the file to
-// the caller in ipc->readRet, then update the seek position.  Returns
-// the number of bytes successfully read, or < 0 on error.
+// Read at most req->req_n bytes from the current seek position in
+// req->req_fileid, then update the seek position.  Rather than copy the
+// data, return the block cache pages holding it (at most FSMAXPAGES,
+// the first being the block that holds the seek position) read-only
+// in *pg_store, *perm_store and *npages_store.  Returns the number of
+// bytes read, or < 0 on error.
+// Reads share fs_lock, so reads through one Fd (by threads of a client,
+// or after fork) take turns on its seek position under o_seek_lock.
 int
-serve_read(envid_t envid, union Fsipc *ipc)
+serve_read(envid_t envid, struct Fsreq_read *req,
+	   void **pg_store, int *perm_store, int *npages_store)
 {
-	struct Fsreq_read *req = &ipc->read;
-	struct Fsret_read *ret = &ipc->readRet;
+	struct OpenFile *o;
+	char *readva = worker_self()->w_readva;
+	off_t off, pos;
+	size_t n;
+	char *blk;
+	int i, r;
 
 	if (debug)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 
-	// Lab 5: Your code here:
-	struct OpenFile* ofp;
-	int r;
-	ssize_t nbytes_read=0;
-	if ((r = openfile_lookup(envid, req->req_fileid, &ofp))<0){
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
+	mutex_lock(&o->o_seek_lock);
+	off = o->o_fd->fd_offset;
+	if (off >= o->o_file->f_size) {
+		r = 0;
+		goto out;
 	}
-	nbytes_read = file_read(ofp->o_file, ret->ret_buf, MIN(req->req_n, PGSIZE), ofp->o_fd->fd_offset);
-	if (nbytes_read>0){
-		ofp->o_fd->fd_offset+=nbytes_read;
+	n = MIN(req->req_n, o->o_file->f_size - off);
+	n = MIN(n, FSMAXPAGES * BLKSIZE - off % BLKSIZE);
+	file_readahead(o->o_file, off, n);
+
+	// IPC sends consecutive pages, so line the blocks up at readva
+	for (i = 0, pos = ROUNDDOWN(off, BLKSIZE); pos < off + n; i++, pos += BLKSIZE) {
+		if ((r = file_map_block(o->o_file, pos, &blk)) == -E_NOT_FOUND) {
+			blk = (char *) ZEROPAGE;
+			r = 0;
+		}
+		if (r >= 0)
+			r = sys_page_map(0, blk, 0, readva + i * PGSIZE, PTE_P|PTE_U);
+		if (r < 0) {
+			if (i == 0)
+				goto out;
+			n = pos - off;	// return what we have
+			break;
+		}
 	}
-	return nbytes_read;
+
+	*pg_store = readva;
+	*perm_store = PTE_P|PTE_U;
+	*npages_store = i;
+	o->o_fd->fd_offset += n;
+	r = n;
+out:
+	mutex_unlock(&o->o_seek_lock);
+	return r;
+}
+
+
+// Map the block of req->req_fileid that contains byte req->req_offset
+// read-only into the caller, by returning the block cache page itself
+// in *pg_store and *perm_store.  The caller sees later writes to the
+// block.  Returns the number of bytes of file data in the block,
+// counting from its start (0, and no page, at end of file), or < 0 on
+// error.  Does not touch the seek position.
+// A hole maps the shared zero page, like serve_read reads it, and so
+// does not see a later write that fills it in.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((r = file_map_block(o->o_file, req->req_offset, &blk)) == -E_NOT_FOUND) {
+		blk = (char *) ZEROPAGE;
+		r = MIN(BLKSIZE, o->o_file->f_size
+			- ROUNDDOWN(req->req_offset, BLKSIZE));
+	}
+	if (r <= 0)
+		return r;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return r;
 }
 
 
@@ -244,10 +462,14 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &ofp))<0){
 		return r;
 	}
+	// the data must lie within the pages we were sent
+	if (req->req_n > worker_self()->w_npages * PGSIZE - offsetof(struct Fsreq_write, req_buf))
+		return -E_INVAL;
 	r = file_write(ofp->o_file, req->req_buf, req->req_n, ofp->o_fd->fd_offset);
 	if (r < 0) {
         return r;
     }
+    file_changed(ofp->o_file);
     ofp->o_fd->fd_offset += r;
 	return r;
 }
@@ -274,6 +496,76 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	return 0;
 }
 
+// Stat the file at ipc->statpath.req_path, returning the same
+// Fsret_stat as serve_stat.
+int
+serve_statpath(envid_t envid, union Fsipc *ipc)
+{
+	char path[MAXPATHLEN];
+	struct Fsret_stat *ret = &ipc->statRet;
+	struct File *f;
+	int r;
+
+	memmove(path, ipc->statpath.req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	if (debug)
+		cprintf("serve_statpath %08x %s\n", envid, path);
+
+	if ((r = file_open(path, &f)) < 0)
+		return r;
+
+	strcpy(ret->ret_name, f->f_name);
+	ret->ret_size = f->f_size;
+	ret->ret_isdir = (f->f_type == FTYPE_DIR);
+	return 0;
+}
+
+// Return up to req_max entries of directory req_fileid in
+// ipc->readdirRet, skipping free slots, starting from byte req_offset
+// (a multiple of sizeof(struct File)).
+// Returns the number of entries, 0 at the end of the directory.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsret_readdir *ret = &ipc->readdirRet;
+	struct OpenFile *o;
+	struct File *f;
+	off_t pos;
+	uint32_t max, n = 0;
+	char *blk;
+	int r;
+
+	// The reply overwrites the request.
+	pos = ipc->readdir.req_offset;
+	max = MIN(ipc->readdir.req_max, FSDIRENTS);
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x %d\n", envid,
+			ipc->readdir.req_fileid, pos);
+
+	if ((r = openfile_lookup(envid, ipc->readdir.req_fileid, &o)) < 0)
+		return r;
+	if (o->o_file->f_type != FTYPE_DIR
+	    || pos < 0 || pos % sizeof(struct File) != 0)
+		return -E_INVAL;
+
+	for (; pos < o->o_file->f_size && n < max; pos += sizeof(struct File)) {
+		if ((r = file_get_block(o->o_file, pos / BLKSIZE, &blk)) < 0)
+			return r;
+		f = (struct File *) (blk + pos % BLKSIZE);
+		if (!f->f_name[0])
+			continue;
+		strcpy(ret->ret_ents[n].d_name, f->f_name);
+		ret->ret_ents[n].d_size = f->f_size;
+		ret->ret_ents[n].d_type = f->f_type;
+		n++;
+	}
+	ret->ret_n = n;
+	ret->ret_offset = pos;
+	return n;
+}
+
 // Flush all data and metadata of req->req_fileid to disk.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
@@ -286,7 +578,33 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	file_flush(o->o_file);
+	// Every close() flushes, so do not make clients wait for the
+	// disk: the write-back thread gets to the blocks soon enough.
+	// sync() and FSRING_FSYNC are there to wait for it.
+	writeback_kick();
+	return 0;
+}
+
+// The client is closing req->req_fileid: flush it like serve_flush, and
+// if the caller holds the last client reference to its Fd page, free the
+// open file.  The server's own mapping goes, so the page the client
+// still has until it unmaps it is never handed to another client.
+int
+serve_close(envid_t envid, struct Fsreq_close *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_close %08x %08x\n", envid, req->req_fileid);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	writeback_kick();
+	if (pageref(o->o_fd) == 2) {
+		sys_page_unmap(0, o->o_fd);
+		openfile_free(o);
+	}
 	return 0;
 }
 
@@ -298,52 +616,351 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the file version page read-only in *pg_store and *perm_store.
+int
+serve_versions(envid_t envid, void **pg_store, int *perm_store)
+{
+	if (debug)
+		cprintf("serve_versions %08x\n", envid);
+
+	*pg_store = (void *) VERSPAGE;
+	*perm_store = PTE_P|PTE_U|PTE_SHARE;
+	return 0;
+}
+
+// Return the block cache statistics in ipc->bcstatRet, after setting
+// its budget to ipc->bcstat.req_budget blocks if that is nonzero.
+int
+serve_bcstat(envid_t envid, union Fsipc *ipc)
+{
+	uint32_t budget = ipc->bcstat.req_budget;
+
+	if (debug)
+		cprintf("serve_bcstat %08x %d\n", envid, budget);
+
+	return bc_stat(budget, &ipc->bcstatRet);
+}
+
+// Forget ring client rc.  Called with ringtab_lock and rc->rc_lock held.
+static void
+ring_free(struct RingClient *rc)
+{
+	int i;
+
+	for (i = 0; i < FSMAXPAGES; i++)
+		sys_page_unmap(0, (char *) rc->rc_ring + i * PGSIZE);
+	rc->rc_envid = 0;
+	rc->rc_ring = NULL;
+}
+
+// Take over the FSMAXPAGES pages the client sent with this request as
+// its asynchronous ring.  Returns 0 on success, < 0 on error.
+int
+serve_ring_setup(envid_t envid, union Fsipc *req)
+{
+	struct RingClient *rc;
+	struct Fsring *ring;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x\n", envid);
+
+	if (worker_self()->w_npages != FSMAXPAGES)
+		return -E_INVAL;
+
+	mutex_lock(&ringtab_lock);
+	// Reuse a free slot, or one whose client is gone: then we
+	// hold the only reference to its ring page.
+	for (i = 0; i < MAXRINGS; i++) {
+		rc = &ringtab[i];
+		if (rc->rc_envid && pageref(rc->rc_ring) == 1) {
+			mutex_lock(&rc->rc_lock);
+			ring_free(rc);
+			mutex_unlock(&rc->rc_lock);
+		}
+		if (!rc->rc_envid)
+			break;
+	}
+	if (i == MAXRINGS) {
+		r = -E_MAX_OPEN;
+		goto out;
+	}
+
+	ring = (struct Fsring *) (RINGVA + i * FSMAXPAGES * PGSIZE);
+	for (i = 0; i < FSMAXPAGES; i++)
+		if ((r = sys_page_map(0, (char *) req + i * PGSIZE,
+				      0, (char *) ring + i * PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0) {
+			rc->rc_ring = ring;
+			ring_free(rc);
+			goto out;
+		}
+	// No one is serving it: the first request needs a doorbell.
+	ring->sq_wakeup = 1;
+	rc->rc_envid = envid;
+	rc->rc_ring = ring;
+	r = 0;
+out:
+	mutex_unlock(&ringtab_lock);
+	return r;
+}
+
+// Carry out one asynchronous request from rc.
+// Returns the result to post on its completion queue.
+static int
+ring_do(struct RingClient *rc, struct Fssqe *sqe)
+{
+	struct OpenFile *o;
+	char *data;
+	int r;
+
+	if (sqe->sqe_slot >= FSRING_SLOTS || sqe->sqe_len > PGSIZE)
+		return -E_INVAL;
+	data = (char *) rc->rc_ring + (sqe->sqe_slot + 1) * PGSIZE;
+
+	if (sqe->sqe_op == FSRING_READ)
+		rwlock_rdlock(&fs_lock);
+	else
+		rwlock_wrlock(&fs_lock);
+	if ((r = openfile_lookup(rc->rc_envid, sqe->sqe_fileid, &o)) < 0)
+		goto out;
+	switch (sqe->sqe_op) {
+	case FSRING_READ:
+		r = file_read(o->o_file, data, sqe->sqe_len, sqe->sqe_offset);
+		break;
+	case FSRING_WRITE:
+		r = file_write(o->o_file, data, sqe->sqe_len, sqe->sqe_offset);
+		if (r > 0)
+			file_changed(o->o_file);
+		break;
+	case FSRING_FSYNC:
+		file_flush(o->o_file);
+		r = 0;
+		break;
+	default:
+		r = -E_INVAL;
+	}
+out:
+	rwlock_unlock(&fs_lock);
+	return r;
+}
+
+// Work through rc's submission queue until it stays empty.
+// Called with rc->rc_lock held.
+static void
+ring_run(struct RingClient *rc)
+{
+	struct Fsring *ring = rc->rc_ring;
+	struct Fssqe sqe;
+	struct Fscqe *cqe;
+	bool posted = false;
+
+	while (1) {
+		while (ring->sq_head != ring->sq_tail) {
+			__sync_synchronize();
+			// copy it: the client may not touch it, but could
+			sqe = ring->sq[ring->sq_head % FSRING_SIZE];
+			ring->sq_head++;
+
+			cqe = &ring->cq[ring->cq_tail % FSRING_SIZE];
+			cqe->cqe_slot = sqe.sqe_slot;
+			cqe->cqe_res = ring_do(rc, &sqe);
+			__sync_synchronize();
+			ring->cq_tail++;
+			posted = true;
+		}
+		// Out of work.  Ask for a doorbell, then look once more in
+		// case the client queued something before seeing the flag.
+		ring->sq_wakeup = 1;
+		__sync_synchronize();
+		if (ring->sq_head == ring->sq_tail)
+			break;
+		ring->sq_wakeup = 0;
+	}
+	if (posted && ring->cq_waiters)
+		sys_futex_wake(&ring->cq_tail, NENV);
+}
+
+// The client rang the doorbell of the ring whose page it sent along:
+// serve that ring until it is empty.  There is no reply.
+static void
+serve_ring_enter(envid_t envid, union Fsipc *req)
+{
+	physaddr_t pa = PTE_ADDR(uvpt[PGNUM(req)]);
+	struct RingClient *rc;
+
+	mutex_lock(&ringtab_lock);
+	for (rc = ringtab; rc < ringtab + MAXRINGS; rc++)
+		if (rc->rc_envid && PTE_ADDR(uvpt[PGNUM(rc->rc_ring)]) == pa)
+			break;
+	mutex_unlock(&ringtab_lock);
+	if (rc == ringtab + MAXRINGS)
+		return;
+
+	mutex_lock(&rc->rc_lock);
+	// It may have been reclaimed and set up again for someone else
+	// while we waited; then the doorbell was for a dead ring.
+	if (rc->rc_envid && PTE_ADDR(uvpt[PGNUM(rc->rc_ring)]) == pa)
+		ring_run(rc);
+	mutex_unlock(&rc->rc_lock);
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open, read, map and versions are handled specially because they
+	// pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
-	[FSREQ_READ] =		serve_read,
+	/* [FSREQ_READ] =	(fshandler)serve_read, */
+	/* [FSREQ_MAP] =	(fshandler)serve_map, */
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
+	[FSREQ_CLOSE] =		(fshandler)serve_close,
+	[FSREQ_READDIR] =	serve_readdir,
+	[FSREQ_STATPATH] =	serve_statpath,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_BCSTAT] =	serve_bcstat
+	// The ring requests do not touch the file system itself, so
+	// serve_request calls them outside fs_lock.
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Serve w's current request and reply to it.
+static void
+serve_request(struct Worker *w)
+{
+	uint32_t req = w->w_type, whom = w->w_whom;
+	union Fsipc *fsreq = w->w_req;
+	int perm = 0, npages = 1, r;
+	void *pg = NULL;
+
+	if (req == FSREQ_RING_ENTER) {
+		serve_ring_enter(whom, fsreq);
+		return;
+	}
+	if (req == FSREQ_RING_SETUP) {
+		r = serve_ring_setup(whom, fsreq);
+		ipc_send(whom, r, NULL, 0);
+		return;
+	}
+
+	if (req == FSREQ_READ || req == FSREQ_STAT || req == FSREQ_MAP
+	    || req == FSREQ_BCSTAT || req == FSREQ_READDIR
+	    || req == FSREQ_STATPATH || req == FSREQ_VERSIONS)
+		rwlock_rdlock(&fs_lock);
+	else
+		rwlock_wrlock(&fs_lock);
+	if (req == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+	} else if (req == FSREQ_MAP) {
+		r = serve_map(whom, (struct Fsreq_map*)fsreq, &pg, &perm);
+	} else if (req == FSREQ_READ) {
+		r = serve_read(whom, (struct Fsreq_read*)fsreq, &pg, &perm, &npages);
+	} else if (req == FSREQ_VERSIONS) {
+		r = serve_versions(whom, &pg, &perm);
+	} else if (req < NHANDLERS && handlers[req]) {
+		r = handlers[req](whom, fsreq);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	rwlock_unlock(&fs_lock);
+	if (bc_dirty_count() > WBHIGH)
+		writeback_kick();
+	// The pages stay valid after unlocking: we hold references.
+	ipc_send_pages(whom, r, pg, npages, perm);
+}
+
+static void *
+writeback(void *arg)
+{
+	while (1) {
+		sys_futex_wait(&wb_kick, 0, WBPERIOD);
+		rwlock_wrlock(&fs_lock);
+		fs_writeback(wb_kick ? 0 : WBAGE);
+		wb_kick = 0;
+		openfile_sweep();
+		rwlock_unlock(&fs_lock);
+	}
+	return NULL;
+}
+
+static void *
+worker(void *arg)
+{
+	struct Worker *w = arg;
+	int i;
+
+	while (1) {
+		sem_wait(&w->w_go);
+		serve_request(w);
+		for (i = 0; i < w->w_npages; i++)
+			sys_page_unmap(0, (char *) w->w_req + i * PGSIZE);
+		if (w->w_type == FSREQ_READ)
+			for (i = 0; i < FSMAXPAGES; i++)
+				sys_page_unmap(0, w->w_readva + i * PGSIZE);
+
+		mutex_lock(&workers_lock);
+		w->w_busy = false;
+		mutex_unlock(&workers_lock);
+		sem_post(&workers_idle);
+	}
+	return NULL;
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	struct Worker *w;
+	uint32_t req;
+	int perm, i, r;
+
+	sem_init(&workers_idle, NWORKERS);
+	for (i = 0; i < NWORKERS; i++) {
+		w = &workers[i];
+		w->w_req = (union Fsipc *) WORKVA(i);
+		w->w_readva = (char *) WORKVA(i) + FSMAXPAGES * PGSIZE;
+		if ((r = uthread_create(&w->w_tid, worker, w)) < 0)
+			panic("serve: uthread_create: %e", r);
+	}
+	if ((r = uthread_create(&wb_tid, writeback, NULL)) < 0)
+		panic("serve: uthread_create: %e", r);
+	ide_irq_init();
 
 	while (1) {
+		// Take an idle worker and receive a request for it.
+		sem_wait(&workers_idle);
+		mutex_lock(&workers_lock);
+		for (w = workers; w->w_busy; w++)
+			;
+		w->w_busy = true;
+		mutex_unlock(&workers_lock);
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_recv_pages((int32_t *) &w->w_whom, w->w_req, FSMAXPAGES,
+				     &perm, &w->w_npages);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+				req, w->w_whom, uvpt[PGNUM(w->w_req)], w->w_req);
 
-		// All requests must contain an argument page
+		// All requests must contain an argument page.  A disk
+		// interrupt that came before a worker claimed it (from
+		// envid 0) has none either, but is no error.
 		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n",
-				whom);
+			if (w->w_whom != 0)
+				cprintf("Invalid request from %08x: no argument page\n",
+					w->w_whom);
+			mutex_lock(&workers_lock);
+			w->w_busy = false;
+			mutex_unlock(&workers_lock);
+			sem_post(&workers_idle);
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		w->w_type = req;
+		sem_post(&w->w_go);
 	}
 }
 
@@ -0,0 +1,125 @@
+// The disk the file system is on: a single IDE disk, or a RAID-0 set
+// that spreads it over one disk on each IDE channel in stripe units of
+// a few blocks (see struct StripeLabel).  A transfer is split into a
+// request per disk, each gathering its units from the caller's buffer
+// into one IDE command, and with DMA the disks work on them at once.
+
+#include "fs.h"
+
+#define MINUNIT		4	// keeps a disk's part of a transfer
+				// within IDEMAXSEG segments
+
+static uint32_t st_ndisks;
+static int st_disks[STRIPEMAX];		// IDE disk numbers, by sl_index
+static uint32_t st_unit;		// sectors per stripe unit
+static uint32_t st_base;		// where the data starts on each disk
+
+static char st_label[SECTSIZE];
+
+// Read the label of disk d into st_label.  Returns it if it is a
+// well-formed label, NULL if not.
+static struct StripeLabel *
+read_label(int d)
+{
+	struct StripeLabel *sl = (struct StripeLabel *) st_label;
+	int r;
+
+	if ((r = ide_rw(d, 0, st_label, 1, 0)) < 0)
+		panic("stripe: reading the label of disk %d: %e", d, r);
+	if (sl->sl_magic != STRIPE_MAGIC || sl->sl_ndisks == 0
+	    || sl->sl_ndisks > STRIPEMAX || sl->sl_index >= sl->sl_ndisks
+	    || sl->sl_unit < MINUNIT)
+		return NULL;
+	return sl;
+}
+
+// Find the file system's disk: the second IDE disk (number 1) if there
+// is one, else the first.  If disk 1 is labeled as part of a striped
+// set, find the rest of the set on the secondary channel.
+void
+stripe_init(void)
+{
+	struct StripeLabel *sl;
+	uint32_t id, ndisks;
+	int d;
+
+	st_ndisks = 1;
+	if (!ide_probe(1)) {
+		st_disks[0] = 0;
+		return;
+	}
+	st_disks[0] = 1;
+	if (!(sl = read_label(1)))
+		return;
+
+	id = sl->sl_id;
+	ndisks = sl->sl_ndisks;
+	st_unit = sl->sl_unit * BLKSECTS;
+	st_base = BLKSECTS;
+	st_disks[sl->sl_index] = 1;
+	for (d = 2; d < 4 && st_ndisks < ndisks; d++) {
+		if (!ide_probe(d) || !(sl = read_label(d)) || sl->sl_id != id
+		    || sl->sl_ndisks != ndisks || sl->sl_unit * BLKSECTS != st_unit)
+			continue;
+		st_disks[sl->sl_index] = d;
+		st_ndisks++;
+	}
+	if (st_ndisks != ndisks)
+		panic("stripe: found %d of the %d disks of the set", st_ndisks,
+		      ndisks);
+	cprintf("stripe: %d disks, %d blocks per unit\n", st_ndisks,
+		st_unit / BLKSECTS);
+}
+
+// Move nsecs sectors between the disk, from secno on, and buf.
+static int
+stripe_rw(uint32_t secno, void *buf, size_t nsecs, bool write)
+{
+	struct IdeReq rq[STRIPEMAX], *q;
+	uint32_t i, n, unit, off;
+	int r = 0, r2;
+
+	if (st_ndisks == 1)
+		return ide_rw(st_disks[0], secno, buf, nsecs, write);
+
+	for (i = 0; i < st_ndisks; i++) {
+		rq[i].ir_disk = st_disks[i];
+		rq[i].ir_write = write;
+		rq[i].ir_nseg = 0;
+	}
+	// Consecutive units on one disk are in consecutive rows, so each
+	// disk's part is one run of its sectors.
+	for (; nsecs > 0; secno += n, buf += n * SECTSIZE, nsecs -= n) {
+		unit = secno / st_unit;
+		off = secno % st_unit;
+		n = MIN(st_unit - off, nsecs);
+		q = &rq[unit % st_ndisks];
+		if (q->ir_nseg == 0)
+			q->ir_secno = st_base + unit / st_ndisks * st_unit + off;
+		assert(q->ir_nseg < IDEMAXSEG);
+		q->ir_seg[q->ir_nseg].is_buf = buf;
+		q->ir_seg[q->ir_nseg].is_nsecs = n;
+		q->ir_nseg++;
+	}
+
+	// The disks are on different channels, so all can be started.
+	for (i = 0; i < st_ndisks; i++)
+		if (rq[i].ir_nseg)
+			ide_start(&rq[i]);
+	for (i = 0; i < st_ndisks; i++)
+		if (rq[i].ir_nseg && (r2 = ide_finish(&rq[i])) < 0)
+			r = r2;
+	return r;
+}
+
+int
+disk_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return stripe_rw(secno, dst, nsecs, 0);
+}
+
+int
+disk_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return stripe_rw(secno, (void *) src, nsecs, 1);
+}
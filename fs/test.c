@@ -5,13 +5,23 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+// Is the block at va safe on disk: in place, or committed to the
+// journal if there is one?
+static bool
+is_stable(void *va)
+{
+	if (journal_enabled())
+		return !bc_pinned(((uint32_t) va - DISKMAP) / BLKSIZE);
+	return !(uvpt[PGNUM(va)] & PTE_D);
+}
+
 void
 fs_test(void)
 {
-	struct File *f;
-	int r;
+	struct File *f, *f2;
+	int r, i;
 	char *blk;
-	uint32_t *bits;
+	uint32_t *bits, start;
 
 	// back up bitmap
 	if ((r = sys_page_alloc(0, (void*) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
@@ -25,8 +35,20 @@ fs_test(void)
 	assert(bits[r/32] & (1 << (r%32)));
 	// and is not free any more
 	assert(!(bitmap[r/32] & (1 << (r%32))));
+	// and the bitmap waits for the next commit
+	assert(!is_stable(&bitmap[r/32]));
 	cprintf("alloc_block is good\n");
 
+	// allocate an extent and give it back
+	if ((r = alloc_block_run(4, &start)) < 0)
+		panic("alloc_block_run: %e", r);
+	for (i = 0; i < r; i++) {
+		assert(!block_is_free(start + i));
+		free_block(start + i);
+		assert(block_is_free(start + i));
+	}
+	cprintf("alloc_block_run is good\n");
+
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
 	else if (r == 0)
@@ -45,23 +67,66 @@ fs_test(void)
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
+	assert(is_stable(bitmap));
 	cprintf("file_flush is good\n");
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
 	assert(f->f_direct[0] == 0);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(!is_stable(f));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(!is_stable(f));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(is_stable(f));
 	cprintf("file rewrite is good\n");
+
+	// a name that was looked up and missed, then created
+	if ((r = file_open("/dindirect", &f)) != -E_NOT_FOUND)
+		panic("file_open /dindirect: %e", r);
+	if ((r = file_create("/dindirect", &f)) < 0)
+		panic("file_create /dindirect: %e", r);
+	if ((r = file_open("/dindirect", &f2)) < 0)
+		panic("file_open /dindirect after create: %e", r);
+	assert(f2 == f);
+	cprintf("directory entry cache is good\n");
+
+	// a sparse file reaching past the indirect block
+	if ((r = file_set_size(f, (NDIRECT + NINDIRECT + 2) * BLKSIZE)) < 0)
+		panic("file_set_size 3: %e", r);
+	if ((r = file_get_block(f, NDIRECT + NINDIRECT + 1, &blk)) < 0)
+		panic("file_get_block 3: %e", r);
+	strcpy(blk, msg);
+	assert(f->f_dindirect && !f->f_indirect);
+	assert(super->s_features & FS_FEAT_DINDIRECT);
+	if ((r = file_find_block(f, NDIRECT + NINDIRECT, &blk)) != -E_NOT_FOUND)
+		panic("file_find_block of a hole: %e", r);
+	if ((r = file_set_size(f, 0)) < 0)
+		panic("file_set_size 4: %e", r);
+	assert(!f->f_dindirect);
+	cprintf("double-indirect block is good\n");
+
+	// small writes wait for a place on disk, and then get one run
+	for (i = 0; i < 2; i++)
+		if ((r = file_write(f, msg, strlen(msg), i * BLKSIZE)) < 0)
+			panic("file_write: %e", r);
+	assert(f->f_direct[0] == 0 && f->f_direct[1] == 0);
+	if ((r = file_read(f, bits, strlen(msg), BLKSIZE)) != strlen(msg)
+	    || memcmp(bits, msg, strlen(msg)) != 0)
+		panic("file_read of a waiting block: %e", r);
+	cprintf("delayed allocation is good\n");
+
+	// writes wait on the dirty list, and sync empties it
+	assert(bc_dirty_count() > 0);
+	fs_sync();
+	assert(f->f_direct[0] != 0 && f->f_direct[1] == f->f_direct[0] + 1);
+	assert(bc_dirty_count() == 0);
+	cprintf("dirty list is good\n");
 }
@@ -29,6 +29,9 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Most pages a single IPC can carry
+#define IPC_MAXPAGES		32
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -46,30 +49,49 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Fields are grouped by who touches them, one group per cache line,
+// so that CPUs scanning env_status or delivering IPC do not keep
+// stealing the lines holding another CPU's saved registers.
 struct Env {
-	struct Trapframe env_tf;	// Saved registers
-	struct Env *env_link;		// Next free Env
+	// Hot: read by every sched_yield() scan and envid2env()
+	unsigned env_status;		// Status of the environment
 	envid_t env_id;			// Unique environment identifier
+	int env_cpunum;			// The CPU that the env is running on
+	int env_fpu_cpu;		// CPU holding our live FPU state, or -1
+	uint32_t env_runs;		// Number of times environment has run
+	struct Env *env_link;		// Next free Env
 	envid_t env_parent_id;		// env_id of this env's parent
 	enum EnvType env_type;		// Indicates special system environments
-	unsigned env_status;		// Status of the environment
-	uint32_t env_runs;		// Number of times environment has run
-	int env_cpunum;			// The CPU that the env is running on
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of this env's exception stack
 
-	// Lab 4 IPC
-	bool env_ipc_recving;		// Env is blocked receiving
+	// Futex wait queue linkage
+	physaddr_t env_futex_pa;	// Word we are sleeping on, or 0
+	struct Env *env_futex_next;	// Next waiter in the same bucket
+	unsigned env_futex_deadline;	// time_msec() to give up at, or 0
+
+	// Lab 4 IPC, written by the sending CPU
+	bool env_ipc_recving __attribute__((aligned(CACHELINE)));
+					// Env is blocked receiving
 	bool env_waits_for_input;
 	bool env_waits_for_output;
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_npages;		// Pages we accept, then pages received
+	uint32_t env_irq_pending;	// IRQs to notify us of (kern/irq.c)
+
+	// Cold: only touched by the CPU entering or leaving the env
+	struct Trapframe env_tf __attribute__((aligned(CACHELINE)));
+					// Saved registers
+	struct FpuState env_fpu __attribute__((aligned(CACHELINE)));
+					// Saved FPU state when not live
 };
 
 #endif // !JOS_INC_ENV_H
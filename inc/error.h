@@ -27,6 +27,9 @@ enum {
 	E_NOT_SUPP	,	// Operation not supported
 	E_RX_EMPTY,    // receive queue is empty
 	E_RX_FULL,
+
+	E_AGAIN		,	// Futex word no longer holds the expected value
+	E_TIMEOUT	,	// Wait timed out
 	MAXERROR
 };
 
@@ -23,8 +23,11 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks a double-indirect block reaches
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// The block pointers reach about 4 GB, but f_size is an off_t.
+#define MAXFILESIZE	0x7FFFF000
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,10 +38,13 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block
+					// (needs FS_FEAT_DINDIRECT)
+	uint32_t f_flags;		// FILE_* flags
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 12];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,29 +54,200 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// File flags
+#define FILE_COMPRESSED	0x1	// data blocks are stored compressed
+				// (needs FS_FEAT_COMPRESS)
+
+// A data block of a compressed file is stored as a ZHeader and the LZ
+// compressed data (see fs/lz.c) in as few sectors as that takes, from
+// the start of the block, or as it is when that would not save a
+// sector.  zh_sum, an FNV-1a hash of the block, tells a real header
+// from file data that only looks like one.
+#define ZHDR_MAGIC	0x4C5A4231	// 'LZB1'
+
+struct ZHeader {
+	uint32_t zh_magic;		// ZHDR_MAGIC
+	uint32_t zh_len;		// bytes of compressed data that follow
+	uint32_t zh_sum;		// hash of the uncompressed block
+};
+
 
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
 
+// Features in s_features.  Images made before there were any have none,
+// and the file system adds FS_FEAT_DINDIRECT once a file needs it.
+#define FS_FEAT_DINDIRECT	0x1	// files may have f_dindirect
+#define FS_FEAT_JOURNAL		0x2	// metadata goes through s_journal
+#define FS_FEAT_COMPRESS	0x4	// files may be FILE_COMPRESSED
+#define FS_FEATURES		(FS_FEAT_DINDIRECT|FS_FEAT_JOURNAL|FS_FEAT_COMPRESS)
+
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_features;		// FS_FEAT_* flags
+	uint32_t s_journal;		// First block of the journal
+	uint32_t s_jblocks;		// and how many blocks it has
+};
+
+// The metadata journal: a header block, then one transaction after
+// another, each a descriptor block naming the blocks logged, their new
+// contents, and a commit block.  See fs/journal.c.
+#define JOURNAL_MAGIC	0x4A524E4C	// 'JRNL'
+#define JDESC_MAGIC	0x4A445343
+#define JCOMMIT_MAGIC	0x4A434D54
+#define JDESCBLOCKS	((BLKSIZE - 12) / 4)	// most blocks one descriptor names
+
+struct JHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// sequence number of the first transaction
+};
+
+struct JDesc {
+	uint32_t jd_magic;		// JDESC_MAGIC
+	uint32_t jd_seq;		// transaction sequence number
+	uint32_t jd_n;			// blocks logged
+	uint32_t jd_blocks[JDESCBLOCKS];	// where they belong
 };
 
+struct JCommit {
+	uint32_t jc_magic;		// JCOMMIT_MAGIC
+	uint32_t jc_seq;		// same as the descriptor's
+	uint32_t jc_sum;		// checksum of the descriptor and blocks
+};
+
+// A file system striped across several disks (RAID-0) starts each of
+// them with a label block.  Block b of the file system is in stripe
+// unit b / sl_unit, which goes to disk (b / sl_unit) % sl_ndisks, in
+// row (b / sl_unit) / sl_ndisks of it; the rows follow the label.
+// See fs/stripe.c.
+#define STRIPE_MAGIC	0x52414430	// 'RAD0'
+#define STRIPEMAX	2		// disks in a set, one per IDE channel
+#define STRIPEUNIT	8		// blocks per stripe unit, as fsformat makes them
+
+struct StripeLabel {
+	uint32_t sl_magic;		// STRIPE_MAGIC
+	uint32_t sl_id;			// the same on every disk of the set
+	uint32_t sl_ndisks;		// disks in the set
+	uint32_t sl_index;		// which of them this one is
+	uint32_t sl_unit;		// blocks per stripe unit
+	uint32_t sl_nblocks;		// blocks in the file system
+};
+
+// Most pages one request or reply may carry.  A write's data runs on
+// from the request page into up to FSMAXPAGES - 1 more pages; a read
+// is answered with up to FSMAXPAGES block cache pages.
+#define FSMAXPAGES	16
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
 	FSREQ_SET_SIZE,
-	// Read returns a Fsret_read on the request page
+	// Read returns the block cache pages covering the data, read-only
 	FSREQ_READ,
 	FSREQ_WRITE,
 	// Stat returns a Fsret_stat on the request page
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns a block cache page read-only instead of a copy
+	FSREQ_MAP,
+	// Share an asynchronous request ring with the server (see below)
+	FSREQ_RING_SETUP,
+	// Tell an idle server to look at our ring; gets no reply
+	FSREQ_RING_ENTER,
+	// Block cache statistics, returned as a BcStat on the request page
+	FSREQ_BCSTAT,
+	// Flush, and free the open file if we were its last user
+	FSREQ_CLOSE,
+	// Readdir returns a batch of Dirents on the request page
+	FSREQ_READDIR,
+	// Stat a file by name, without opening it; returns a Fsret_stat
+	FSREQ_STATPATH,
+	// Returns the file version page read-only (see below)
+	FSREQ_VERSIONS
+};
+
+// The server counts the changes to each file's contents and size in
+// one page of FSNVERS counters, which clients map read-only at
+// FSVERS_VA to tell whether data they buffered is stale.  An open
+// file's counter is fd_file.vslot in its Fd; files may share one.
+#define FSNVERS		(PGSIZE / sizeof(uint32_t))
+#define FSVERS_VA	0xCFC00000
+
+// A directory entry, as FSREQ_READDIR returns them
+struct Dirent {
+	char d_name[MAXNAMELEN];
+	off_t d_size;
+	uint32_t d_type;		// FTYPE_REG or FTYPE_DIR
+};
+
+// Most Dirents one FSREQ_READDIR reply holds
+#define FSDIRENTS	((PGSIZE - 2 * sizeof(uint32_t)) / sizeof(struct Dirent))
+
+// Most blocks the block cache may be set to hold at once, and the
+// fewest (see FSREQ_BCSTAT)
+#define BCMAXBLOCKS	4096
+#define BCMINBLOCKS	16
+
+// Block cache statistics
+struct BcStat {
+	uint32_t bs_budget;		// most blocks it holds at once
+	uint32_t bs_resident;		// blocks it holds now
+	volatile uint32_t bs_hits;	// lookups of blocks it held
+	uint32_t bs_misses;		// blocks read from disk on a fault
+	uint32_t bs_prefetched;		// blocks read from disk ahead of use
+	uint32_t bs_evictions;
+	uint32_t bs_writebacks;		// dirty blocks written back to evict them
+	uint32_t bs_dirty;		// blocks waiting to be written back
+	uint32_t bs_sectors;		// sectors read or written
+};
+
+// Asynchronous requests.  A client shares an Fsring page, followed by
+// FSRING_SLOTS data pages, with the server using FSREQ_RING_SETUP.  It
+// then queues Fssqe entries on the submission queue and collects Fscqe
+// entries, in any order, from the completion queue.  The server sets
+// sq_wakeup when it runs out of work; a client that sees it set must
+// send FSREQ_RING_ENTER after queueing.  The server wakes clients asleep
+// on the cq_tail futex.  Request slot i transfers its data through data
+// page i, so at most FSRING_SLOTS requests are in flight per client.
+#define FSRING_SLOTS	(FSMAXPAGES - 1)
+#define FSRING_SIZE	16		// queue length, a power of 2
+#define FSRING_VA	0xCFD00000	// where a client keeps its ring;
+					// fork does not copy it
+
+// Asynchronous operations
+enum {
+	FSRING_READ = 1,	// pread sqe_len bytes into the slot's page
+	FSRING_WRITE,		// pwrite sqe_len bytes from the slot's page
+	FSRING_FSYNC		// flush the file to disk
+};
+
+struct Fssqe {
+	uint32_t sqe_op;
+	uint32_t sqe_slot;		// request slot, < FSRING_SLOTS
+	int sqe_fileid;
+	off_t sqe_offset;
+	size_t sqe_len;			// at most PGSIZE
+};
+
+struct Fscqe {
+	uint32_t cqe_slot;
+	int32_t cqe_res;		// bytes transferred, or < 0 on error
+};
+
+struct Fsring {
+	volatile uint32_t sq_head;	// next entry the server takes
+	volatile uint32_t sq_tail;	// next entry the client fills
+	volatile uint32_t sq_wakeup;	// server is idle, needs FSREQ_RING_ENTER
+	volatile uint32_t cq_head;	// next completion the client takes
+	volatile uint32_t cq_tail;	// next completion the server fills
+	volatile uint32_t cq_waiters;	// clients asleep on cq_tail
+	struct Fssqe sq[FSRING_SIZE];
+	struct Fscqe cq[FSRING_SIZE];
 };
 
 union Fsipc {
@@ -86,12 +263,10 @@ union Fsipc {
 		int req_fileid;
 		size_t req_n;
 	} read;
-	struct Fsret_read {
-		char ret_buf[PGSIZE];
-	} readRet;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
+		// may continue into the pages following the request
 		char req_buf[PGSIZE - (sizeof(int) + sizeof(size_t))];
 	} write;
 	struct Fsreq_stat {
@@ -105,9 +280,33 @@ union Fsipc {
 	struct Fsreq_flush {
 		int req_fileid;
 	} flush;
+	struct Fsreq_close {
+		int req_fileid;
+	} close;
+	struct Fsreq_readdir {
+		int req_fileid;
+		off_t req_offset;	// where in the directory to start
+		uint32_t req_max;	// most entries to return
+	} readdir;
+	struct Fsret_readdir {
+		uint32_t ret_n;
+		off_t ret_offset;	// where the next batch starts
+		struct Dirent ret_ents[FSDIRENTS];
+	} readdirRet;
+	struct Fsreq_statpath {
+		char req_path[MAXPATHLEN];
+	} statpath;
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsreq_bcstat {
+		uint32_t req_budget;	// new budget, or 0 to leave it
+	} bcstat;
+	struct BcStat bcstatRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
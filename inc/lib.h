@@ -22,6 +22,8 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/uthread.h>
+#include <inc/sync.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,7 +32,7 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+#define thisenv (uthread_tls()->ut_env)	// per thread, see uthread.h
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
@@ -64,10 +66,16 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
+int	sys_ipc_recv_pages(void *rcv_pg, int maxpages);
 unsigned int sys_time_msec(void);
 int sys_net_try_send(void *va, size_t length);
 int sys_net_recv(void *va);
 int sys_get_mac_addr(void *addr);
+envid_t	sys_thread_create(void *eip, void *esp, void *xstacktop);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout_ms);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
+int	sys_irq_listen(int irq);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -85,6 +93,9 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, int maxpages,
+		       int *perm_store, int *npages_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
@@ -101,13 +112,22 @@ void	close_all(void);
 ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
-int	stat(const char *path, struct Stat *statbuf);
 
 // file.c
 int	open(const char *path, int mode);
+int	stat(const char *path, struct Stat *statbuf);
+int	readdir(int fd, struct Dirent *ents, size_t n);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_flush_buffers(void);
+int	fs_bcstat(uint32_t budget, struct BcStat *st);
+int	fmap(int fd, void *va, size_t len, off_t offset);
+void	funmap(void *va, size_t len);
+int	fs_async_read(int fd, void *buf, size_t n, off_t offset);
+int	fs_async_write(int fd, const void *buf, size_t n, off_t offset);
+int	fs_async_fsync(int fd);
+int	fs_async_wait(int handle);
 
 // pageref.c
 int	pageref(void *addr);
@@ -158,5 +178,6 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#define O_COMPRESS	0x1000		/* store an empty file compressed */
 
 #endif	// !JOS_INC_LIB_H
@@ -0,0 +1,58 @@
+#ifndef JOS_INC_SYNC_H
+#define JOS_INC_SYNC_H 1
+
+#include <inc/types.h>
+
+// Blocking synchronization built on sys_futex_wait/sys_futex_wake.
+// Futexes are keyed by physical address, so these work between the
+// threads of one program and between envs sharing a PTE_SHARE page.
+// All of them are ready to use when zero-filled, except that a zeroed
+// semaphore starts with count 0.
+
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 held, 2 held with waiters
+};
+
+struct Cond {
+	volatile uint32_t c_seq;	// bumped by every signal/broadcast
+};
+
+struct Semaphore {
+	volatile uint32_t s_count;
+	volatile uint32_t s_waiters;
+};
+
+// Many readers or one writer.  Waiting writers hold off new readers.
+struct RWLock {
+	struct Mutex rw_mu;
+	struct Cond rw_cond;
+	int rw_readers;			// readers holding the lock
+	int rw_writer;			// 1 if a writer holds it
+	int rw_wwait;			// writers waiting for it
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0 }
+
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+bool	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+
+void	cond_init(struct Cond *c);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+int	cond_timedwait(struct Cond *c, struct Mutex *m, unsigned timeout_ms);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+
+void	sem_init(struct Semaphore *s, uint32_t count);
+void	sem_wait(struct Semaphore *s);
+bool	sem_trywait(struct Semaphore *s);
+void	sem_post(struct Semaphore *s);
+
+void	rwlock_init(struct RWLock *rw);
+void	rwlock_rdlock(struct RWLock *rw);
+void	rwlock_wrlock(struct RWLock *rw);
+void	rwlock_unlock(struct RWLock *rw);
+
+#endif /* !JOS_INC_SYNC_H */
@@ -21,6 +21,10 @@ enum {
 	SYS_net_try_send,
 	SYS_net_recv,
 	SYS_get_mac_addr,
+	SYS_thread_create,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_irq_listen,
 	NSYSCALLS
 };
 
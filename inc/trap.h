@@ -37,6 +37,9 @@
 #define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
+#define IRQ_IDE2        15	// the secondary IDE channel
+#define IRQ_TLBFLUSH    17	// IPI: flush TLB for a shared page directory
+#define IRQ_RESCHED     18	// IPI: wake a halted CPU to run a new env
 #define IRQ_ERROR       19
 
 #ifndef __ASSEMBLER__
@@ -74,6 +77,27 @@ struct Trapframe {
 	uint16_t tf_padding4;
 } __attribute__((packed));
 
+// Memory image written by FXSAVE and read by FXRSTOR.
+// Must be 16-byte aligned.
+struct FpuState {
+	uint16_t fpu_fcw;		/* x87 control word */
+	uint16_t fpu_fsw;		/* x87 status word */
+	uint8_t fpu_ftw;		/* abridged x87 tag word */
+	uint8_t fpu_reserved1;
+	uint16_t fpu_fop;
+	uint32_t fpu_fip;
+	uint16_t fpu_fcs;
+	uint16_t fpu_reserved2;
+	uint32_t fpu_fdp;
+	uint16_t fpu_fds;
+	uint16_t fpu_reserved3;
+	uint32_t fpu_mxcsr;		/* SSE control/status */
+	uint32_t fpu_mxcsr_mask;
+	uint8_t fpu_st[8][16];		/* ST0-7/MM0-7 */
+	uint8_t fpu_xmm[8][16];		/* XMM0-7 */
+	uint8_t fpu_reserved4[224];
+} __attribute__((packed, aligned(16)));
+
 struct UTrapframe {
 	/* information about the fault */
 	uint32_t utf_fault_va;	/* va for T_PGFLT, 0 otherwise */
@@ -0,0 +1,103 @@
+#ifndef JOS_INC_UTHREAD_H
+#define JOS_INC_UTHREAD_H 1
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/env.h>
+
+// Preemptive user threads.  Each thread is an environment that shares
+// its creator's address space (see sys_thread_create), so threads of
+// one program run on all CPUs at once.
+//
+// Every thread but the initial one owns a UTHREAD_SIZE slot in
+// [UTHREADS, UTHREADS_END):
+//
+//	+7 pages  IPC request page (fsipcbuf/nsipcbuf for this thread)
+//	+6 pages  exception stack, topped at slot base + 7 pages
+//	+5 pages  guard
+//	+1 pages  stack, UTHREAD_STKPAGES pages; struct UThread sits on top
+//	 0        guard
+//
+// so a thread finds its own struct UThread from its stack pointer.
+
+#define UTHREADS		0xe0000000
+#define UTHREAD_SIZE		(8 * PGSIZE)
+#define UTHREAD_MAX		64
+#define UTHREADS_END		(UTHREADS + UTHREAD_MAX * UTHREAD_SIZE)
+#define UTHREAD_STKPAGES	4
+
+#define UTHREAD_STACK(slot)	((slot) + PGSIZE)
+#define UTHREAD_STACKTOP(slot)	((slot) + (1 + UTHREAD_STKPAGES) * PGSIZE)
+#define UTHREAD_XSTACKTOP(slot)	((slot) + 7 * PGSIZE)
+#define UTHREAD_IPCBUF(slot)	((slot) + 7 * PGSIZE)
+
+typedef envid_t uthread_t;
+
+// Thread-local state.
+struct UThread {
+	const volatile struct Env *ut_env;	// thisenv for this thread
+	uthread_t ut_id;
+	void *(*ut_func)(void *);
+	void *ut_arg;
+	void *ut_ret;
+	volatile uint32_t ut_state;
+} __attribute__((aligned(16)));
+
+enum {
+	UT_RUNNING = 0,
+	UT_EXITED,
+};
+
+// The initial thread's state lives alone in a page of its own, so that
+// sfork can give each side a private copy.
+union UThreadMain {
+	struct UThread t;
+	char pad[PGSIZE];
+};
+extern union UThreadMain uthread_main;
+
+static inline bool
+uthread_in_slot(uintptr_t va)
+{
+	return va >= UTHREADS && va < UTHREADS_END;
+}
+
+static inline struct UThread *
+uthread_tls(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (!uthread_in_slot(esp))
+		return &uthread_main.t;
+	return (struct UThread *) (UTHREAD_STACKTOP(ROUNDDOWN(esp, UTHREAD_SIZE))
+				   - sizeof(struct UThread));
+}
+
+// Per-thread request page for IPC stubs: mainbuf for the initial thread.
+static inline void *
+uthread_ipcbuf(void *mainbuf)
+{
+	uintptr_t esp = read_esp();
+
+	if (!uthread_in_slot(esp))
+		return mainbuf;
+	return (void *) UTHREAD_IPCBUF(ROUNDDOWN(esp, UTHREAD_SIZE));
+}
+
+// Is va some thread's exception stack (never to be made copy-on-write)?
+static inline bool
+uthread_is_xstack(uintptr_t va)
+{
+	return uthread_in_slot(va)
+		&& ROUNDDOWN(va, PGSIZE) == UTHREAD_XSTACKTOP(ROUNDDOWN(va, UTHREAD_SIZE)) - PGSIZE;
+}
+
+int	uthread_create(uthread_t *tid, void *(*func)(void *), void *arg);
+int	uthread_join(uthread_t tid, void **ret_store);
+void	uthread_exit(void *ret) __attribute__((noreturn));
+uthread_t uthread_self(void);
+void	uthread_kill_others(void);
+void	uthread_fork_child(void);
+
+#endif // !JOS_INC_UTHREAD_H
@@ -27,6 +27,9 @@ static __inline void lcr3(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr3(void) __attribute__((always_inline));
 static __inline void lcr4(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr4(void) __attribute__((always_inline));
+static __inline void clts(void) __attribute__((always_inline));
+static __inline void fxsave(void *area) __attribute__((always_inline));
+static __inline void fxrstor(const void *area) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
 static __inline uint32_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint32_t eflags) __attribute__((always_inline));
@@ -217,6 +220,24 @@ rcr4(void)
 	return cr4;
 }
 
+static __inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
+static __inline void
+fxsave(void *area)
+{
+	__asm __volatile("fxsave %0" : "=m" (*(uint8_t (*)[512]) area));
+}
+
+static __inline void
+fxrstor(const void *area)
+{
+	__asm __volatile("fxrstor %0" : : "m" (*(const uint8_t (*)[512]) area));
+}
+
 static __inline void
 tlbflush(void)
 {
@@ -293,4 +314,29 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically replace *addr with newval if it equals expected.
+// Returns the old value of *addr either way.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t expected, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (expected) :
+			"cc");
+	return result;
+}
+
+// Atomically add delta to *addr, returning the old value.
+static inline uint32_t
+atomic_add(volatile uint32_t *addr, uint32_t delta)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (delta), "+m" (*addr) :
+			:
+			"cc");
+	return delta;
+}
+
 #endif /* !JOS_INC_X86_H */
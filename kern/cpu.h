@@ -3,6 +3,7 @@
 #define JOS_INC_CPU_H
 
 #include <inc/types.h>
+#include <inc/x86.h>
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
@@ -17,13 +18,17 @@ enum {
 	CPU_HALTED,
 };
 
-// Per-CPU state
+// Per-CPU state, padded to whole cache lines so that CPUs updating
+// their own entry do not bounce each other's lines.
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
-};
+	struct Env *cpu_fpu_owner;      // Env whose state is in the FPU, if any
+	volatile bool cpu_tlb_flush;    // Another CPU asked us to flush our TLB
+	bool cpu_resched;               // Sent IRQ_RESCHED since we halted
+} __attribute__((aligned(CACHELINE)));
 
 // Initialized in mpconfig.c
 extern struct CpuInfo cpus[NCPU];
@@ -34,13 +39,29 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
+int lapic_cpunum(void);
 #define thiscpu (&cpus[cpunum()])
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
-void lapic_ipi(int vector);
+void lapic_ipi(int apicid, int vector);
+
+// The index of the running CPU.  Every CPU runs on its own kernel stack
+// (reachable both at KSTACKTOP - i * (KSTKSIZE + KSTKGAP) and through
+// percpu_kstacks[i]), so the stack pointer tells us who we are without
+// an uncached LAPIC read.  Only the boot stack needs the LAPIC.
+static inline int
+cpunum(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp < KSTACKTOP && esp >= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP))
+		return (KSTACKTOP - 1 - esp) / (KSTKSIZE + KSTKGAP);
+	if (esp - (uintptr_t) percpu_kstacks < sizeof(percpu_kstacks))
+		return (esp - (uintptr_t) percpu_kstacks) / KSTKSIZE;
+	return lapic_cpunum();
+}
 
 #endif
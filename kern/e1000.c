@@ -433,6 +433,7 @@ bool e1000_handler(int trapno) {
             if (env->env_status == ENV_WAITING_FOR_IO && env->env_waits_for_input) {
                 env->env_waits_for_input = false;
                 env->env_status = ENV_RUNNABLE;
+                sched_kick();
             }
         }
     }
@@ -443,6 +444,7 @@ bool e1000_handler(int trapno) {
             if (env->env_status == ENV_WAITING_FOR_IO && env->env_waits_for_output) {
                 env->env_waits_for_output = false;
                 env->env_status = ENV_RUNNABLE;
+                sched_kick();
             }
         }
     }
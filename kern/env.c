@@ -14,6 +14,8 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/fpu.h>
+#include <kern/futex.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -99,7 +101,9 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// If checkperm is set, the specified environment
 	// must be either the current environment
 	// or an immediate child of the current environment.
-	if (checkperm && e != curenv && e->env_parent_id != curenv->env_id) {
+	// Threads sharing an address space may also manage each other.
+	if (checkperm && e != curenv && e->env_parent_id != curenv->env_id
+	    && e->env_pgdir != curenv->env_pgdir) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -264,6 +268,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
@@ -273,6 +278,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	e->env_waits_for_output = false;
 
+	// Start with a clean FPU, loaded lazily on first use.
+	fpu_env_init(e);
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -281,6 +289,31 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
+//
+// Allocates a new env that shares parent's address space (a thread).
+// The new env starts out as env_alloc() leaves it; the caller sets up
+// its registers.
+//
+// Returns 0 on success, < 0 on failure, as env_alloc().
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *parent)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, parent->env_id)) < 0)
+		return r;
+
+	// Trade the fresh page directory for the parent's.
+	page_decref(pa2page(PADDR(e->env_pgdir)));
+	e->env_pgdir = parent->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+
+	*newenv_store = e;
+	return 0;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -444,6 +477,7 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	bool shared;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
@@ -451,12 +485,18 @@ env_free(struct Env *e)
 	if (e == curenv)
 		lcr3(PADDR(kern_pgdir));
 
+	// Whatever FPU state e left loaded is garbage now.
+	fpu_env_free(e);
+	futex_cancel(e);
+
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// unless other threads are still running in it.
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	shared = pa2page(PADDR(e->env_pgdir))->pp_ref > 1;
+	for (pdeno = 0; !shared && pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
@@ -571,6 +611,7 @@ env_run(struct Env *e)
 	curenv->env_status=ENV_RUNNING;
 	curenv->env_runs++;
 	lcr3(PADDR(curenv->env_pgdir));
+	fpu_switch(curenv);
 
     unlock_kernel();
 
@@ -13,6 +13,7 @@ extern struct Segdesc gdt[];
 void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc_thread(struct Env **e, struct Env *parent);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
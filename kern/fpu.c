@@ -0,0 +1,125 @@
+// Lazy FPU/SSE context switching.
+//
+// Each CPU keeps the FPU state of at most one environment live in its
+// registers (thiscpu->cpu_fpu_owner).  CR0.TS is set whenever any other
+// environment runs, so the first x87/MMX/SSE instruction it executes
+// raises T_DEVICE.  Only then do we FXSAVE the previous owner and
+// FXRSTOR the new one; environments that never touch the FPU never pay
+// for a save or restore.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/fpu.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+
+#define CPUID_FXSR	(1 << 24)	// FXSAVE/FXRSTOR supported
+#define CPUID_SSE	(1 << 25)	// SSE supported
+
+// Per-CPU initialization: enable FXSAVE/SSE and arm CR0.TS.
+void
+fpu_init(void)
+{
+	uint32_t edx, cr4;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_FXSR))
+		panic("fpu_init: CPU %d lacks FXSAVE/FXRSTOR", cpunum());
+
+	cr4 = rcr4() | CR4_OSFXSR;
+	if (edx & CPUID_SSE)
+		cr4 |= CR4_OSXMMEXCPT;
+	lcr4(cr4);
+
+	lcr0((rcr0() | CR0_MP | CR0_NE | CR0_TS) & ~CR0_EM);
+	thiscpu->cpu_fpu_owner = NULL;
+}
+
+// Give a new environment the FPU state FNINIT would produce,
+// with all SSE exceptions masked.
+void
+fpu_env_init(struct Env *e)
+{
+	memset(&e->env_fpu, 0, sizeof(e->env_fpu));
+	e->env_fpu.fpu_fcw = 0x37f;
+	e->env_fpu.fpu_mxcsr = 0x1f80;
+	e->env_fpu_cpu = -1;
+}
+
+// Forget e's live state, wherever it is.  Called when e is freed.
+void
+fpu_env_free(struct Env *e)
+{
+	if (e->env_fpu_cpu >= 0) {
+		cpus[e->env_fpu_cpu].cpu_fpu_owner = NULL;
+		e->env_fpu_cpu = -1;
+	}
+}
+
+// Called by env_run() just before e returns to user mode:
+// let e use the FPU directly only if its state is already loaded.
+void
+fpu_switch(struct Env *e)
+{
+	uint32_t cr0;
+
+	if (thiscpu->cpu_fpu_owner == e) {
+		clts();
+		return;
+	}
+	cr0 = rcr0();
+	if (!(cr0 & CR0_TS))
+		lcr0(cr0 | CR0_TS);
+}
+
+// Handle T_DEVICE from user mode: curenv touched the FPU while TS was set.
+void
+fpu_trap(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct Env *owner = c->cpu_fpu_owner;
+
+	clts();
+	if (owner == curenv)
+		return;
+	assert(curenv->env_fpu_cpu < 0);
+
+	if (owner) {
+		fxsave(&owner->env_fpu);
+		owner->env_fpu_cpu = -1;
+	}
+	fxrstor(&curenv->env_fpu);
+	c->cpu_fpu_owner = curenv;
+	curenv->env_fpu_cpu = c->cpu_id;
+}
+
+// Write e's state back to e->env_fpu if it is live on this CPU.
+// The registers stay loaded, so e keeps ownership.
+void
+fpu_save(struct Env *e)
+{
+	if (thiscpu->cpu_fpu_owner != e)
+		return;
+	clts();
+	fxsave(&e->env_fpu);
+}
+
+// Save and drop this CPU's owner, so that the owner can migrate to
+// other CPUs.  Called before the CPU halts.
+void
+fpu_release(void)
+{
+	struct CpuInfo *c = thiscpu;
+	struct Env *owner = c->cpu_fpu_owner;
+
+	if (!owner)
+		return;
+	clts();
+	fxsave(&owner->env_fpu);
+	owner->env_fpu_cpu = -1;
+	c->cpu_fpu_owner = NULL;
+	lcr0(rcr0() | CR0_TS);
+}
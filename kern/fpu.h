@@ -0,0 +1,25 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void fpu_init(void);
+void fpu_env_init(struct Env *e);
+void fpu_env_free(struct Env *e);
+void fpu_switch(struct Env *e);
+void fpu_trap(void);
+void fpu_save(struct Env *e);
+void fpu_release(void);
+
+// An environment whose FPU state is still live in another CPU's
+// registers must keep running on that CPU until the state is saved.
+static inline bool
+fpu_runnable_on(struct Env *e, int cpu)
+{
+	return e->env_fpu_cpu < 0 || e->env_fpu_cpu == cpu;
+}
+
+#endif /* JOS_KERN_FPU_H */
@@ -0,0 +1,124 @@
+// Fast user-space mutexes.
+//
+// A waiter sleeps on a 32-bit word identified by its physical address,
+// so every environment that maps the page -- threads sharing a page
+// directory, or envs sharing a PTE_SHARE page at different addresses --
+// agrees on the key.  Waiters on each hash bucket are kept in FIFO
+// order on a singly linked list through env_futex_next.
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/futex.h>
+#include <kern/env.h>
+#include <kern/time.h>
+#include <kern/sched.h>
+
+#define FUTEX_NHASH	64
+
+static struct Env *futex_queue[FUTEX_NHASH];
+static int futex_ntimed;		// waiters with a deadline
+
+static struct Env **
+futex_bucket(physaddr_t pa)
+{
+	return &futex_queue[(pa >> 2) % FUTEX_NHASH];
+}
+
+// Unlink e from its bucket.  e must be waiting.
+static void
+futex_unlink(struct Env *e)
+{
+	struct Env **pp;
+
+	for (pp = futex_bucket(e->env_futex_pa); *pp != e; pp = &(*pp)->env_futex_next)
+		assert(*pp);
+	*pp = e->env_futex_next;
+	e->env_futex_next = NULL;
+	e->env_futex_pa = 0;
+	if (e->env_futex_deadline) {
+		e->env_futex_deadline = 0;
+		futex_ntimed--;
+	}
+}
+
+// Put e to sleep on the word at physical address pa, for at most
+// timeout_ms milliseconds (0 means forever).  The caller sets the
+// value sys_futex_wait returns when e is woken normally.
+void
+futex_wait(struct Env *e, physaddr_t pa, unsigned timeout_ms)
+{
+	struct Env **pp;
+
+	assert(pa != 0 && e->env_futex_pa == 0);
+	for (pp = futex_bucket(pa); *pp; pp = &(*pp)->env_futex_next)
+		/* find the tail */;
+	*pp = e;
+	e->env_futex_next = NULL;
+	e->env_futex_pa = pa;
+	e->env_futex_deadline = 0;
+	if (timeout_ms) {
+		// 0 is reserved for "no deadline"
+		e->env_futex_deadline = (time_msec() + timeout_ms) | 1;
+		futex_ntimed++;
+	}
+	e->env_status = ENV_NOT_RUNNABLE;
+}
+
+// Wake up to n environments waiting on pa, oldest first.
+// Returns the number woken.
+int
+futex_wake(physaddr_t pa, int n)
+{
+	struct Env **pp, *e;
+	int woken = 0;
+
+	pp = futex_bucket(pa);
+	while (*pp && woken < n) {
+		e = *pp;
+		if (e->env_futex_pa != pa) {
+			pp = &e->env_futex_next;
+			continue;
+		}
+		futex_unlink(e);
+		e->env_status = ENV_RUNNABLE;
+		woken++;
+	}
+	if (woken)
+		sched_kick();
+	return woken;
+}
+
+// Take e off any futex queue without waking it.
+// Called when e is freed or its status is changed behind its back.
+void
+futex_cancel(struct Env *e)
+{
+	if (e->env_futex_pa)
+		futex_unlink(e);
+}
+
+// Wake every waiter whose deadline has passed; sys_futex_wait
+// returns -E_TIMEOUT to them.  Called from the timer interrupt.
+void
+futex_expire(unsigned now)
+{
+	struct Env **pp, *e;
+	int i;
+
+	if (futex_ntimed == 0)
+		return;
+	for (i = 0; i < FUTEX_NHASH; i++) {
+		pp = &futex_queue[i];
+		while ((e = *pp)) {
+			if (e->env_futex_deadline
+			    && (int) (now - e->env_futex_deadline) >= 0) {
+				futex_unlink(e);
+				e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+				e->env_status = ENV_RUNNABLE;
+				sched_kick();
+			} else
+				pp = &e->env_futex_next;
+		}
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void futex_wait(struct Env *e, physaddr_t pa, unsigned timeout_ms);
+int futex_wake(physaddr_t pa, int n);
+void futex_cancel(struct Env *e);
+void futex_expire(unsigned now);
+
+#endif /* JOS_KERN_FUTEX_H */
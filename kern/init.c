@@ -16,6 +16,7 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/pci.h>
+#include <kern/fpu.h>
 
 static void boot_aps(void);
 
@@ -42,6 +43,7 @@ i386_init(void)
 	// Lab 3 user environment initialization functions
 	env_init();
 	trap_init();
+	fpu_init();
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
@@ -127,6 +129,7 @@ mp_main(void)
 	lapic_init();
 	env_init_percpu();
 	trap_init_percpu();
+	fpu_init();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
@@ -0,0 +1,91 @@
+// Device interrupts for user-level drivers.
+//
+// An environment with I/O privilege can claim an IRQ the kernel does
+// not handle itself.  Each time the IRQ fires, the listener gets an
+// IPC from envid 0 whose value is the IRQ number: at once if it is
+// blocked in sys_ipc_recv, or else on its next sys_ipc_recv, from a
+// bit left pending in env_irq_pending.  Several firings before a
+// receive collapse into one notification.
+
+#include <inc/error.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+
+#include <kern/irq.h>
+#include <kern/env.h>
+#include <kern/picirq.h>
+#include <kern/sched.h>
+
+static envid_t irq_listener[MAX_IRQS];	// 0 if the kernel owns the IRQ
+
+// Make e the environment notified of irq, forgetting any notification
+// still pending for it.  The IRQ may move between the threads of a
+// program, but not to or from the kernel's own devices, nor away from
+// another program that is still listening.
+// Returns 0 on success, -E_INVAL if irq is out of range, handled by the
+// kernel or another program, or e lacks I/O privilege.
+int
+irq_listen(struct Env *e, int irq)
+{
+	struct Env *old;
+
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_SLAVE
+	    || (e->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_INVAL;
+	if (!irq_listener[irq] && !(irq_mask_8259A & (1 << irq)))
+		return -E_INVAL;
+	if (irq_listener[irq] && envid2env(irq_listener[irq], &old, 0) == 0
+	    && old->env_pgdir != e->env_pgdir)
+		return -E_INVAL;
+
+	e->env_irq_pending &= ~(1 << irq);
+	irq_listener[irq] = e->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Deliver the lowest pending IRQ to e as if it had been sent by envid
+// 0, if it has one pending.  Returns true if it did.
+bool
+irq_recv(struct Env *e)
+{
+	int irq;
+
+	if (!e->env_irq_pending)
+		return false;
+	irq = __builtin_ctz(e->env_irq_pending);
+	e->env_irq_pending &= ~(1 << irq);
+
+	e->env_ipc_recving = false;
+	e->env_ipc_from = 0;
+	e->env_ipc_value = irq;
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	return true;
+}
+
+// Handle a trap that is a user-claimed IRQ.  Returns true if it was;
+// the caller still has to acknowledge it.
+bool
+irq_notify(int trapno)
+{
+	int irq = trapno - IRQ_OFFSET;
+	struct Env *e;
+
+	if (irq < 0 || irq >= MAX_IRQS || !irq_listener[irq])
+		return false;
+
+	// A listener that is gone leaves the IRQ masked, still claimed.
+	if (envid2env(irq_listener[irq], &e, 0) < 0) {
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+		return true;
+	}
+	e->env_irq_pending |= 1 << irq;
+	if (e->env_ipc_recving && e->env_status == ENV_NOT_RUNNABLE) {
+		irq_recv(e);
+		e->env_tf.tf_regs.reg_eax = 0;
+		e->env_status = ENV_RUNNABLE;
+		sched_kick();
+	}
+	return true;
+}
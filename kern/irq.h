@@ -0,0 +1,13 @@
+#ifndef JOS_KERN_IRQ_H
+#define JOS_KERN_IRQ_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int irq_listen(struct Env *e, int irq);
+bool irq_notify(int trapno);
+bool irq_recv(struct Env *e);
+
+#endif /* JOS_KERN_IRQ_H */
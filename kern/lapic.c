@@ -111,8 +111,9 @@ lapic_init(void)
 	lapicw(TPR, 0);
 }
 
+// The running CPU's local APIC ID.  Use cpunum() instead.
 int
-cpunum(void)
+lapic_cpunum(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
@@ -173,10 +174,12 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send interrupt vector to the CPU whose local APIC ID is apicid.
 void
-lapic_ipi(int vector)
+lapic_ipi(int apicid, int vector)
 {
-	lapicw(ICRLO, OTHERS | FIXED | vector);
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
@@ -569,14 +569,21 @@ page_remove(pde_t *pgdir, void *va)
 	if (page == NULL) {
 		return;
 	}
-	tlb_invalidate(pgdir, va);
-	memset(page_table_entry, 0, sizeof(pte_t));
+	// A CPU sets PTE_A before it caches a translation, so if it is
+	// still clear no TLB holds this one.  Clear the entry atomically,
+	// so that a CPU walking it right now either sets PTE_A first or
+	// finds it not present.
+	if (xchg(page_table_entry, 0) & PTE_A)
+		tlb_invalidate(pgdir, va);
 	page_decref(page);
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// If threads on other CPUs share pgdir, the TLBs of the CPUs running
+// one of them right now are flushed too.  Only called for an entry
+// that was present, and has been used since it was mapped.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
@@ -584,6 +591,47 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+
+	if (pgdir != kern_pgdir && pa2page(PADDR(pgdir))->pp_ref > 1)
+		tlb_shootdown(pgdir);
+}
+
+//
+// Make every other CPU currently running on pgdir flush its TLB,
+// and wait until all of them have done so.
+//
+// We hold the big kernel lock, so the targets must not need it to
+// answer: they flush either from the IRQ_TLBFLUSH handler, which runs
+// before trap() takes the lock, or while spinning for the lock.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || !c->cpu_env || c->cpu_env->env_pgdir != pgdir)
+			continue;
+		c->cpu_tlb_flush = true;
+		lapic_ipi(c->cpu_id, IRQ_OFFSET + IRQ_TLBFLUSH);
+	}
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_tlb_flush)
+			asm volatile("pause");
+}
+
+//
+// Flush this CPU's TLB if tlb_shootdown() asked us to.
+//
+void
+tlb_flush_pending(void)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (c->cpu_tlb_flush) {
+		lcr3(rcr3());
+		c->cpu_tlb_flush = false;
+	}
 }
 
 //
@@ -4,6 +4,7 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/fpu.h>
 
 void sched_halt(void);
 
@@ -40,9 +41,11 @@ sched_yield(void)
     }
 
     int i;
+    int cpu = cpunum();
     for (i = 0; i < NENV; i++) {
         struct Env *env = &envs[(env_id + i) % NENV];
-        if (env->env_status == ENV_RUNNABLE) {
+        // skip envs whose FPU state is still loaded on another cpu
+        if (env->env_status == ENV_RUNNABLE && fpu_runnable_on(env, cpu)) {
             // running first available env
             env_run(env);
         }
@@ -57,6 +60,24 @@ sched_yield(void)
 	sched_halt();
 }
 
+// Call after making an environment runnable.  If another CPU is
+// halted, send it IRQ_RESCHED so it runs the env now instead of at
+// its next timer tick.  Each halted CPU is kicked at most once, so a
+// burst of wakeups spreads over the idle CPUs.
+void
+sched_kick(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_status != CPU_HALTED || c->cpu_resched)
+			continue;
+		c->cpu_resched = true;
+		lapic_ipi(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+		return;
+	}
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
 //
@@ -81,6 +102,9 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
+	// Save any FPU state we hold so its owner can run elsewhere
+	fpu_release();
+
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
@@ -88,6 +112,7 @@ sched_halt(void)
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
+	thiscpu->cpu_resched = false;
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
 	// Release the big kernel lock as if we were "leaving" the kernel
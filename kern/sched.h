@@ -9,4 +9,6 @@
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_kick(void);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -13,6 +13,9 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/fpu.h>
+#include <kern/futex.h>
+#include <kern/irq.h>
 
 // returns true if the given address
 // can be mapped to in user mode
@@ -118,6 +121,10 @@ sys_exofork(void)
     new_env->env_tf = curenv->env_tf;
     new_env->env_tf.tf_regs.reg_eax = 0;
 
+    // the child inherits our FPU state too, which may still be live
+    fpu_save(curenv);
+    new_env->env_fpu = curenv->env_fpu;
+
     return new_env->env_id;
 }
 
@@ -148,7 +155,12 @@ sys_env_set_status(envid_t envid, int status)
         return -E_INVAL;
     }
 
+    // an explicit status change overrides any futex wait
+    futex_cancel(env);
     env->env_status = status;
+    if (status == ENV_RUNNABLE) {
+        sched_kick();
+    }
 
     return 0;
 }
@@ -343,8 +355,9 @@ sys_page_unmap(envid_t envid, void *va)
 }
 
 // Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// If srcva < UTOP, then also send the 'npages' pages currently mapped
+// at 'srcva' (npages == 0 means 1), so that receiver gets duplicate
+// mappings of the same pages, at consecutive addresses from its dstva.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -357,6 +370,7 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
 //    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -376,17 +390,24 @@ sys_page_unmap(envid_t envid, void *va)
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
 //		address space.
+//	-E_INVAL if the receiver wants fewer than npages pages.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+                 unsigned npages)
 {
 	// LAB 4: Your code here.
     int r;
+    unsigned i;
     struct Env *target_env;
 
+    if (npages == 0) {
+        npages = 1;
+    }
+
     r = envid2env(envid, &target_env, false);
     if (r < 0) {
         return r;
@@ -405,26 +426,39 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
         if (!is_valid_perm(perm)) {
             return -E_INVAL;
         }
-        pte_t *src_entry;
-        struct PageInfo * src_page = page_lookup(curenv->env_pgdir,
-                                                srcva, &src_entry);
-        if (src_page == NULL) {
+        if (npages > target_env->env_ipc_npages
+            || (uintptr_t)srcva + npages * PGSIZE > UTOP) {
             return -E_INVAL;
         }
-        if ((perm & PTE_W) != 0 && (*src_entry & PTE_W) == 0) {
-            return -E_INVAL;
+        // check every page before mapping any
+        pte_t *src_entry;
+        struct PageInfo *src_page;
+        for (i = 0; i < npages; i++) {
+            src_page = page_lookup(curenv->env_pgdir,
+                                   srcva + i * PGSIZE, &src_entry);
+            if (src_page == NULL) {
+                return -E_INVAL;
+            }
+            if ((perm & PTE_W) != 0 && (*src_entry & PTE_W) == 0) {
+                return -E_INVAL;
+            }
         }
 
-        r = page_insert(target_env->env_pgdir, src_page,
-                        target_env->env_ipc_dstva, perm);
-        if (r < 0) {
-            return r;
+        for (i = 0; i < npages; i++) {
+            src_page = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, NULL);
+            r = page_insert(target_env->env_pgdir, src_page,
+                            target_env->env_ipc_dstva + i * PGSIZE, perm);
+            if (r < 0) {
+                return r;
+            }
         }
 
         target_env->env_ipc_perm = perm;
+        target_env->env_ipc_npages = npages;
 
     } else {
         target_env->env_ipc_perm = 0;
+        target_env->env_ipc_npages = 0;
     }
 
     target_env->env_ipc_value = value;
@@ -433,6 +467,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     // set the return value of recv to 0 for success
     target_env->env_tf.tf_regs.reg_eax = 0;
     target_env->env_status = ENV_RUNNABLE;
+    sched_kick();
     return 0;
 }
 
@@ -440,22 +475,33 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP, then you are willing to receive up to 'maxpages'
+// pages of data (maxpages == 0 means 1), mapped from 'dstva' on.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned,
+//		maxpages > IPC_MAXPAGES or the pages would reach past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, unsigned maxpages)
 {
 	// LAB 4: Your code here.
+    if (maxpages == 0) {
+        maxpages = 1;
+    }
     if ((uintptr_t)dstva < UTOP
-        && ROUNDDOWN(dstva, PGSIZE) != dstva) {
+        && (ROUNDDOWN(dstva, PGSIZE) != dstva
+            || maxpages > IPC_MAXPAGES
+            || (uintptr_t)dstva + maxpages * PGSIZE > UTOP)) {
         return -E_INVAL;
     }
+    // a device interrupt that came in meanwhile is waiting for us
+    if (irq_recv(curenv)) {
+        return 0;
+    }
     curenv->env_ipc_dstva = dstva;
+    curenv->env_ipc_npages = maxpages;
     curenv->env_ipc_recving = true;
     curenv->env_status = ENV_NOT_RUNNABLE;
 	sched_yield();
@@ -520,6 +566,112 @@ int32_t sys_get_mac_addr(void *addr) {
     return 0;
 }
 
+// Creates a thread: a new runnable environment that shares the
+// current environment's address space.  It starts at 'eip' with stack
+// pointer 'esp', inherits the caller's page fault upcall and uses the
+// exception stack ending at 'xstacktop'.  Its FPU state starts clean.
+//
+// Returns envid of the new thread on success, < 0 on error.  Errors are:
+//	-E_INVAL if eip, esp or xstacktop are above UTOP,
+//		or xstacktop is not page-aligned.
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+    struct Env *thread;
+    int r;
+
+    if (eip >= UTOP || esp > UTOP || xstacktop > UTOP
+        || xstacktop % PGSIZE != 0) {
+        return -E_INVAL;
+    }
+
+    if ((r = env_alloc_thread(&thread, curenv)) < 0) {
+        return r;
+    }
+
+    // keep the caller's segments and eflags (including IOPL)
+    thread->env_tf = curenv->env_tf;
+    thread->env_tf.tf_eip = eip;
+    thread->env_tf.tf_esp = esp;
+    thread->env_tf.tf_regs.reg_eax = 0;
+    thread->env_pgfault_upcall = curenv->env_pgfault_upcall;
+    thread->env_xstacktop = xstacktop;
+    sched_kick();
+
+    return thread->env_id;
+}
+
+// Translate the user address of a futex word into its physical address.
+// Returns 0 on success, -E_INVAL if addr is misaligned, above UTOP or
+// not mapped user-readable in curenv.
+static int
+futex_lookup(uint32_t *addr, physaddr_t *pa_store)
+{
+    struct PageInfo *pp;
+    pte_t *pte;
+
+    if ((uintptr_t)addr >= UTOP || (uintptr_t)addr % sizeof(uint32_t) != 0) {
+        return -E_INVAL;
+    }
+    pp = page_lookup(curenv->env_pgdir, addr, &pte);
+    if (pp == NULL || !(*pte & PTE_U)) {
+        return -E_INVAL;
+    }
+    *pa_store = page2pa(pp) + PGOFF(addr);
+    return 0;
+}
+
+// Block until woken by sys_futex_wake on the same word, provided *addr
+// still equals val.  The word is keyed by physical address, so any env
+// mapping the same page can wake us.  timeout_ms == 0 waits forever.
+// Returns 0 when woken, < 0 on error.  Errors are:
+//	-E_INVAL if addr is invalid (see futex_lookup).
+//	-E_AGAIN if *addr != val.
+//	-E_TIMEOUT if timeout_ms elapsed first.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, unsigned timeout_ms)
+{
+    physaddr_t pa;
+    int r;
+
+    if ((r = futex_lookup(addr, &pa)) < 0) {
+        return r;
+    }
+    // the big kernel lock orders this check against sys_futex_wake
+    if (*(volatile uint32_t *)KADDR(pa) != val) {
+        return -E_AGAIN;
+    }
+    futex_wait(curenv, pa, timeout_ms);
+    curenv->env_tf.tf_regs.reg_eax = 0;
+    sched_yield();
+}
+
+// Wake up to n envs blocked in sys_futex_wait on addr.
+// Returns the number woken, or -E_INVAL if addr is invalid.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+    physaddr_t pa;
+    int r;
+
+    if ((r = futex_lookup(addr, &pa)) < 0) {
+        return r;
+    }
+    return futex_wake(pa, n);
+}
+
+// Have IRQ irq delivered to the caller as an IPC from envid 0 carrying
+// the IRQ number (see kern/irq.c).  Only envs with I/O privilege may
+// listen, and only to IRQs that neither the kernel nor another program
+// handles.  Returns 0 on success, -E_INVAL otherwise.
+static int
+sys_irq_listen(int irq)
+{
+    return irq_listen(curenv, irq);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -554,9 +706,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_env_set_pgfault_upcall:
             return sys_env_set_pgfault_upcall(a1, (void*)a2);
         case SYS_ipc_recv:
-            return sys_ipc_recv((void*)a1);
+            return sys_ipc_recv((void*)a1, a2);
         case SYS_ipc_try_send:
-            return sys_ipc_try_send(a1, a2, (void*)a3, a4);
+            return sys_ipc_try_send(a1, a2, (void*)a3, a4, a5);
         case SYS_env_set_trapframe:
             return sys_env_set_trapframe(a1, (struct Trapframe *)a2);
         case SYS_time_msec:
@@ -567,6 +719,14 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             return sys_net_recv((void*)a1);
         case SYS_get_mac_addr:
             return sys_get_mac_addr((void*)a1);
+        case SYS_thread_create:
+            return sys_thread_create(a1, a2, a3);
+        case SYS_futex_wait:
+            return sys_futex_wait((uint32_t *)a1, a2, a3);
+        case SYS_futex_wake:
+            return sys_futex_wake((uint32_t *)a1, a2);
+        case SYS_irq_listen:
+            return sys_irq_listen(a1);
         default:
             return -E_INVAL;
 	}
@@ -15,6 +15,9 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/fpu.h>
+#include <kern/futex.h>
+#include <kern/irq.h>
 
 static struct Taskstate ts;
 
@@ -194,6 +197,10 @@ trap_dispatch(struct Trapframe *tf)
             return page_fault_handler(tf);
         case T_BRKPT:
             return monitor(tf);
+        case T_DEVICE:
+            if ((tf->tf_cs & 3) != 3)
+                break; // the kernel never uses the fpu
+            return fpu_trap();
         case T_SYSCALL:
             tf->tf_regs.reg_eax =
                 syscall(tf->tf_regs.reg_eax,
@@ -229,11 +236,18 @@ trap_dispatch(struct Trapframe *tf)
         // make the boot cpu solely responsible for the ticks
         if (cpunum() == bootcpu->cpu_id) {
             time_tick();
+            futex_expire(time_msec());
         }
         lapic_eoi();
 		sched_yield();
 	}
 
+	// Another CPU made an env runnable while we were halted.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		sched_yield();
+	}
+
 	// Handle keyboard and serial interrupts.
 	// LAB 5: Your code here.
 
@@ -253,6 +267,13 @@ trap_dispatch(struct Trapframe *tf)
         sched_yield();
     }
 
+	// IRQs claimed by user-level drivers with sys_irq_listen
+	if (irq_notify(tf->tf_trapno)) {
+		irq_eoi();
+		lapic_eoi();
+		sched_yield();
+	}
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -263,6 +284,20 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Return from a trap without going through env_run().
+static void __attribute__((noreturn))
+trap_return(struct Trapframe *tf)
+{
+	asm volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -275,6 +310,14 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Answer TLB shootdowns without the big kernel lock:
+	// the CPU waiting for our answer is holding it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLBFLUSH) {
+		tlb_flush_pending();
+		lapic_eoi();
+		trap_return(tf);
+	}
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -384,9 +427,10 @@ page_fault_handler(struct Trapframe *tf)
     //
     // without allowing exception_stack to be tf->tf_esp
     // when it is below the exception stack, overflow checks cant be made
-    uintptr_t exception_stack = tf->tf_esp < UXSTACKTOP
-                                && tf->tf_esp >= USTACKTOP ?
-                                tf->tf_esp : UXSTACKTOP;
+    uintptr_t xstacktop = curenv->env_xstacktop;
+    uintptr_t exception_stack = tf->tf_esp < xstacktop
+                                && tf->tf_esp >= xstacktop - 2 * PGSIZE ?
+                                tf->tf_esp : xstacktop;
 
     // ensures the exception stack has atleast enough space
     // for an empty word and the trapframe
@@ -4,6 +4,7 @@
 void
 exit(void)
 {
+	uthread_kill_others();
 	close_all();
 	sys_env_destroy(0);
 }
@@ -2,8 +2,6 @@
 
 #define debug		0
 
-// Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
@@ -307,15 +305,3 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
-int
-stat(const char *path, struct Stat *stat)
-{
-	int fd, r;
-
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return fd;
-	r = fstat(fd, stat);
-	close(fd);
-	return r;
-}
-
@@ -5,30 +5,53 @@
 #define debug 0
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
+// Each thread sends its requests from its own page.
+#define fsipcbuf (*(union Fsipc *) uthread_ipcbuf(&fsipcbuf))
+
+// Windows for requests bigger than a page, just below the fd table.
+// The server maps the blocks a read returns at FSREADWIN; large writes
+// are sent from FSWRITEWIN.  Threads take turns using them.
+#define FSREADWIN	((char *) 0xCFE00000)
+#define FSWRITEWIN	((union Fsipc *) 0xCFF00000)
+static struct Mutex fswin_lock;
+
+static envid_t
+fsenv(void)
+{
+	static envid_t id;
+	if (id == 0)
+		id = ipc_find_env(ENV_TYPE_FS);
+	return id;
+}
 
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.
 // type: request code, passed as the simple integer IPC value.
-// dstva: virtual address at which to receive reply page, 0 if none.
+// req, npages: the request, which may run on for several pages.
+// dstva, maxpages: where to receive up to maxpages reply pages,
+//	0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_pages(unsigned type, void *req, int npages, void *dstva, int maxpages)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
-	static_assert(sizeof(fsipcbuf) == PGSIZE);
-
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	ipc_send_pages(fsenv(), type, req, npages, PTE_P | PTE_W | PTE_U);
+	return ipc_recv_pages(NULL, dstva, maxpages, NULL, NULL);
 }
 
-static int devfile_flush(struct Fd *fd);
+// Send the request in fsipcbuf to the file server, and wait for a
+// reply.  Parts of the response may be written back to fsipcbuf.
+// dstva: virtual address at which to receive reply page, 0 if none.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	static_assert(sizeof(fsipcbuf) == PGSIZE);
+	return fsipc_pages(type, &fsipcbuf, 1, dstva, 1);
+}
+
+static int devfile_close(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
@@ -39,12 +62,138 @@ struct Dev devfile =
 	.dev_id =	'f',
 	.dev_name =	"file",
 	.dev_read =	devfile_read,
-	.dev_close =	devfile_flush,
+	.dev_close =	devfile_close,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
 	.dev_trunc =	devfile_trunc
 };
 
+// Buffering.  Small reads and writes would each cost a round trip to
+// the server, so every open file gets a buffer in its fd's data page
+// (fd2data), private to this environment.  A read that misses fills it
+// with up to FBSIZE bytes from the seek position on; the seek position
+// itself only moves past what was read, since it is shared with any
+// other environment using the fd.  Buffered data is good only while
+// the file's counter in the version page is what it was at the fill.
+// Writes that follow each other are collected in it, and sent along
+// when the next write does not follow on or fit, before anything else
+// is done with the file, and on close; fork, spawn and sync send every
+// buffer's.  An error sending them is returned by whatever sent them.
+#define FBSIZE		(PGSIZE - 5 * sizeof(uint32_t))
+
+struct Filebuf {
+	int fb_fileid;		// the open file buffered, 0 if none
+	off_t fb_off;		// file offset of fb_data[0]
+	uint32_t fb_len;	// bytes buffered
+	uint32_t fb_version;	// for reads: the file's version at the fill
+	uint32_t fb_dirty;	// holds writes not sent yet
+	char fb_data[FBSIZE];
+};
+
+static struct Mutex filebuf_lock;
+
+static ssize_t read_server(struct Fd *fd, void *buf, size_t n);
+static ssize_t write_server(struct Fd *fd, const void *buf, size_t n);
+
+static bool
+va_mapped(const void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Return fd's buffer if it has one in this environment, else NULL.
+// Called with filebuf_lock held.
+static struct Filebuf *
+filebuf_lookup(struct Fd *fd)
+{
+	struct Filebuf *fb;
+	struct Fd *fd2;
+
+	// Only fds in the fd table have a data page.
+	if (fd_lookup(fd2num(fd), &fd2) < 0 || fd2 != fd)
+		return NULL;
+	fb = (struct Filebuf *) fd2data(fd);
+	if (!va_mapped(fb) || fb->fb_fileid != fd->fd_file.id)
+		return NULL;
+	return fb;
+}
+
+// Return fd's buffer, setting one up if need be, or NULL if fd has to
+// go without.  Called with filebuf_lock held.
+static struct Filebuf *
+filebuf(struct Fd *fd)
+{
+	struct Filebuf *fb;
+	struct Fd *fd2;
+
+	static_assert(sizeof(struct Filebuf) == PGSIZE);
+	if ((fb = filebuf_lookup(fd)) != NULL)
+		return fb;
+	if (fd_lookup(fd2num(fd), &fd2) < 0 || fd2 != fd)
+		return NULL;
+	if (!va_mapped((void *) FSVERS_VA)
+	    && fsipc(FSREQ_VERSIONS, (void *) FSVERS_VA) < 0)
+		return NULL;
+	fb = (struct Filebuf *) fd2data(fd);
+	if (!va_mapped(fb) && sys_page_alloc(0, fb, PTE_P|PTE_U|PTE_W) < 0)
+		return NULL;
+	fb->fb_fileid = fd->fd_file.id;
+	fb->fb_len = 0;
+	fb->fb_dirty = 0;
+	return fb;
+}
+
+// Send the writes collected in fd's buffer fb to the server, and empty
+// it.  Returns 0 on success, < 0 on error.  Called with filebuf_lock
+// held.
+static int
+filebuf_flush(struct Fd *fd, struct Filebuf *fb)
+{
+	off_t off = fd->fd_offset;
+	uint32_t i;
+	int r = 0;
+
+	if (!fb->fb_dirty)
+		return 0;
+	fd->fd_offset = fb->fb_off;
+	for (i = 0; i < fb->fb_len; i += r)
+		if ((r = write_server(fd, fb->fb_data + i, fb->fb_len - i)) <= 0)
+			break;
+	fd->fd_offset = off;
+	fb->fb_len = 0;
+	fb->fb_dirty = 0;
+	return r < 0 ? r : 0;
+}
+
+// Send fd's collected writes, if any, to the server.
+static int
+filebuf_sync(struct Fd *fd)
+{
+	struct Filebuf *fb;
+	int r = 0;
+
+	mutex_lock(&filebuf_lock);
+	if ((fb = filebuf_lookup(fd)) != NULL)
+		r = filebuf_flush(fd, fb);
+	mutex_unlock(&filebuf_lock);
+	return r;
+}
+
+// Send the writes collected in every open file's buffer to the server.
+// Returns 0 on success, or the first error.
+int
+fs_flush_buffers(void)
+{
+	struct Fd *fd;
+	int i, r, err = 0;
+
+	for (i = 0; i < MAXFD; i++)
+		if (fd_lookup(i, &fd) == 0 && fd->fd_dev_id == devfile.dev_id
+		    && (r = filebuf_sync(fd)) < 0 && err == 0)
+			err = r;
+	return err;
+}
+
 // Open a file (or directory).
 //
 // Returns:
@@ -88,53 +237,202 @@ open(const char *path, int mode)
 	return fd2num(fd);
 }
 
-// Flush the file descriptor.  After this the fileid is invalid.
+// Close the file descriptor.  After this the fileid is invalid.
 //
 // This function is called by fd_close.  fd_close will take care of
-// unmapping the FD page from this environment.  Since the server uses
-// the reference counts on the FD pages to detect which files are
-// open, unmapping it is enough to free up server-side resources.
-// Other than that, we just have to make sure our changes are flushed
-// to disk.
+// unmapping the FD page from this environment; the buffer goes here,
+// after its writes are sent.  The server flushes our changes to disk
+// and, unless a forked child still shares the Fd page, frees the open
+// file right away.  (If we exit without closing, it notices from the
+// page's reference count later.)
 static int
-devfile_flush(struct Fd *fd)
+devfile_close(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	struct Filebuf *fb;
+	int r = 0, r2;
+
+	mutex_lock(&filebuf_lock);
+	if ((fb = filebuf_lookup(fd)) != NULL) {
+		r = filebuf_flush(fd, fb);
+		sys_page_unmap(0, fb);
+	}
+	mutex_unlock(&filebuf_lock);
+	fsipcbuf.close.req_fileid = fd->fd_file.id;
+	r2 = fsipc(FSREQ_CLOSE, NULL);
+	return r < 0 ? r : r2;
+}
+
+// Map the file system's block cache page holding byte 'offset' of
+// 'fd' read-only at 'va'.
+// Returns the number of bytes of file data in the page, counting from
+// its start (0 at end of file, when nothing is mapped), or < 0 on error.
+static int
+devfile_map(struct Fd *fd, void *va, off_t offset)
+{
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, va);
 }
 
-// Read at most 'n' bytes from 'fd' at the current position into 'buf'.
+// Read at most 'n' bytes from 'fd' at the current position into 'buf'
+// from the server, past any buffer.  One request returns up to
+// FSMAXPAGES blocks.
 //
 // Returns:
 // 	The number of bytes successfully read.
 // 	< 0 on error.
 static ssize_t
-devfile_read(struct Fd *fd, void *buf, size_t n)
+read_server(struct Fd *fd, void *buf, size_t n)
 {
-	// Make an FSREQ_READ request to the file system server after
-	// filling fsipcbuf.read with the request arguments.  The
-	// bytes read will be written back to fsipcbuf by the file
-	// system server.
+	// The server maps the block cache pages holding the data at
+	// FSREADWIN, starting with the block the seek position is in,
+	// and advances the seek position.  Copy straight out of them,
+	// then unmap them: the server does not evict a block while we
+	// have it mapped.
+	off_t off = fd->fd_offset;
 	int r;
 
+	mutex_lock(&fswin_lock);
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
-		return r;
-	assert(r <= n);
-	assert(r <= PGSIZE);
-	memmove(buf, fsipcbuf.readRet.ret_buf, r);
+	if ((r = fsipc_pages(FSREQ_READ, &fsipcbuf, 1, FSREADWIN, FSMAXPAGES)) > 0) {
+		assert(r <= n);
+		memmove(buf, FSREADWIN + PGOFF(off), r);
+		funmap(FSREADWIN, PGOFF(off) + r);
+	}
+	mutex_unlock(&fswin_lock);
+	return r;
+}
+
+// Read at most 'n' bytes from 'fd' at the current position into 'buf',
+// through fd's buffer if the read is smaller than it.
+//
+// Returns:
+// 	The number of bytes successfully read.
+// 	< 0 on error.
+static ssize_t
+devfile_read(struct Fd *fd, void *buf, size_t n)
+{
+	volatile uint32_t *vers = (volatile uint32_t *) FSVERS_VA;
+	struct Filebuf *fb;
+	off_t off = fd->fd_offset;
+	uint32_t v;
+	int r;
+
+	mutex_lock(&filebuf_lock);
+	fb = filebuf(fd);
+	if (fb && (r = filebuf_flush(fd, fb)) < 0)
+		goto out;
+	if (!fb || n >= FBSIZE) {
+		r = read_server(fd, buf, n);
+		goto out;
+	}
+	// Take the version before the fill, so that a change the fill
+	// may have missed still shows.
+	v = vers[fd->fd_file.vslot % FSNVERS];
+	if (fb->fb_version != v || off < fb->fb_off
+	    || off >= fb->fb_off + fb->fb_len) {
+		fb->fb_len = 0;
+		if ((r = read_server(fd, fb->fb_data, FBSIZE)) <= 0)
+			goto out;
+		fb->fb_off = off;
+		fb->fb_len = r;
+		fb->fb_version = v;
+	}
+	r = MIN(n, fb->fb_off + fb->fb_len - off);
+	memmove(buf, fb->fb_data + (off - fb->fb_off), r);
+	fd->fd_offset = off + r;
+out:
+	mutex_unlock(&filebuf_lock);
 	return r;
 }
 
+// Map 'len' bytes of the file open as 'fdnum', starting at 'offset',
+// read-only at 'va'.  'va' and 'offset' must be page-aligned.  The
+// pages are the file server's block cache pages, so nothing is copied,
+// and later writes to the file show through, except into holes, which
+// map a shared page of zeros.  Pages past the end of the file are left
+// unmapped, and the bytes past the end of file in the last page are
+// whatever the block holds.  Undo with funmap.
+// Returns the number of bytes of file data mapped, or < 0 on error.
+int
+fmap(int fdnum, void *va, size_t len, off_t offset)
+{
+	struct Fd *fd;
+	size_t i;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (PGOFF(va) || PGOFF(offset) || (uintptr_t) va + len > UTOP)
+		return -E_INVAL;
+	if ((r = filebuf_sync(fd)) < 0)
+		return r;
+
+	for (i = 0; i < len; i += PGSIZE) {
+		if ((r = devfile_map(fd, (char *) va + i, offset + i)) < 0) {
+			funmap(va, i);
+			return r;
+		}
+		if (r < PGSIZE)
+			return i + MIN(r, len - i);
+	}
+	return len;
+}
+
+// Undo fmap.
+void
+funmap(void *va, size_t len)
+{
+	size_t i;
 
-// Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
+	for (i = 0; i < len; i += PGSIZE)
+		sys_page_unmap(0, (char *) va + i);
+}
+
+
+// Write a buffer too big for fsipcbuf in as few requests as possible,
+// each carrying the data in up to FSMAXPAGES pages from FSWRITEWIN.
+// Returns the number of bytes written, or < 0 if nothing was written.
+static ssize_t
+devfile_write_pages(struct Fd *fd, const void *buf, size_t n)
+{
+	const size_t hdr = offsetof(struct Fsreq_write, req_buf);
+	size_t tot, m;
+	int npages, i, r = 0;
+
+	mutex_lock(&fswin_lock);
+	for (tot = 0; tot < n; tot += r) {
+		m = MIN(n - tot, FSMAXPAGES * PGSIZE - hdr);
+		npages = ROUNDUP(hdr + m, PGSIZE) / PGSIZE;
+		for (i = 0; i < npages; i++) {
+			char *va = (char *) FSWRITEWIN + i * PGSIZE;
+			if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+				if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+					goto out;
+		}
+		FSWRITEWIN->write.req_fileid = fd->fd_file.id;
+		FSWRITEWIN->write.req_n = m;
+		memmove(FSWRITEWIN->write.req_buf, (const char *) buf + tot, m);
+		if ((r = fsipc_pages(FSREQ_WRITE, FSWRITEWIN, npages, NULL, 0)) <= 0)
+			break;
+		assert(r <= m);
+	}
+out:
+	mutex_unlock(&fswin_lock);
+	return tot > 0 ? tot : r;
+}
+
+// Write at most 'n' bytes from 'buf' to 'fd' at the current seek
+// position, past any buffer.
 //
 // Returns:
 //	 The number of bytes successfully written.
 //	 < 0 on error.
 static ssize_t
-devfile_write(struct Fd *fd, const void *buf, size_t n)
+write_server(struct Fd *fd, const void *buf, size_t n)
 {
 	// Make an FSREQ_WRITE request to the file system server.  Be
 	// careful: fsipcbuf.write.req_buf is only so large, but
@@ -142,8 +440,8 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
 	int r;
-	// ensure that the size is at most the req_buf size
-    n = MIN(n, PGSIZE - (sizeof(int) + sizeof(size_t)));
+	if (n > sizeof(fsipcbuf.write.req_buf))
+		return devfile_write_pages(fd, buf, n);
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 	memmove(fsipcbuf.write.req_buf, buf, n);
@@ -153,11 +451,52 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	return r;
 }
 
+// Write at most 'n' bytes from 'buf' to 'fd' at the current seek
+// position.  A write smaller than fd's buffer is collected there.
+//
+// Returns:
+//	 The number of bytes successfully written (or buffered).
+//	 < 0 on error, which may be from sending earlier writes.
+static ssize_t
+devfile_write(struct Fd *fd, const void *buf, size_t n)
+{
+	struct Filebuf *fb;
+	off_t off = fd->fd_offset;
+	int r;
+
+	mutex_lock(&filebuf_lock);
+	fb = filebuf(fd);
+	if (fb && n < FBSIZE) {
+		if (fb->fb_dirty && (off != fb->fb_off + fb->fb_len
+				     || fb->fb_len + n > FBSIZE)
+		    && (r = filebuf_flush(fd, fb)) < 0)
+			goto out;
+		if (!fb->fb_dirty) {
+			fb->fb_off = off;
+			fb->fb_len = 0;
+			fb->fb_dirty = 1;
+		}
+		memmove(fb->fb_data + fb->fb_len, buf, n);
+		fb->fb_len += n;
+		fd->fd_offset = off + n;
+		r = n;
+		goto out;
+	}
+	if (fb && (r = filebuf_flush(fd, fb)) < 0)
+		goto out;
+	r = write_server(fd, buf, n);
+out:
+	mutex_unlock(&filebuf_lock);
+	return r;
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
 	int r;
 
+	if ((r = filebuf_sync(fd)) < 0)
+		return r;
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
 	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
 		return r;
@@ -167,10 +506,59 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	return 0;
 }
 
+// Stat the file at 'path'.  One request, with no open file involved.
+int
+stat(const char *path, struct Stat *st)
+{
+	int r;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.statpath.req_path, path);
+	if ((r = fsipc(FSREQ_STATPATH, NULL)) < 0)
+		return r;
+	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
+	st->st_size = fsipcbuf.statRet.ret_size;
+	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	st->st_dev = &devfile;
+	return 0;
+}
+
+// Read up to n entries of the directory open as 'fdnum' into ents,
+// going on from its seek position, and move the seek position past
+// them.  Free directory slots are skipped.  Reads at most FSDIRENTS
+// entries per call.
+// Returns the number of entries read, 0 at the end of the directory,
+// or < 0 on error.
+int
+readdir(int fdnum, struct Dirent *ents, size_t n)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.readdir.req_fileid = fd->fd_file.id;
+	fsipcbuf.readdir.req_offset = fd->fd_offset;
+	fsipcbuf.readdir.req_max = n;
+	if ((r = fsipc(FSREQ_READDIR, NULL)) < 0)
+		return r;
+	memmove(ents, fsipcbuf.readdirRet.ret_ents, r * sizeof(struct Dirent));
+	fd->fd_offset = fsipcbuf.readdirRet.ret_offset;
+	return r;
+}
+
 // Truncate or extend an open file to 'size' bytes
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
+	int r;
+
+	if ((r = filebuf_sync(fd)) < 0)
+		return r;
 	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
 	fsipcbuf.set_size.req_size = newsize;
 	return fsipc(FSREQ_SET_SIZE, NULL);
@@ -182,8 +570,196 @@ int
 sync(void)
 {
 	// Ask the file server to update the disk
-	// by writing any dirty blocks in the buffer cache.
+	// by writing any dirty blocks in the buffer cache,
+	// after sending it what our own buffers hold.
+	int r, r2;
+
+	r = fs_flush_buffers();
+	r2 = fsipc(FSREQ_SYNC, NULL);
+	return r < 0 ? r : r2;
+}
+
+// Get the file server's block cache statistics.  If budget is nonzero,
+// first set the most blocks the cache may hold to budget.
+int
+fs_bcstat(uint32_t budget, struct BcStat *st)
+{
+	int r;
+
+	fsipcbuf.bcstat.req_budget = budget;
+	if ((r = fsipc(FSREQ_BCSTAT, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.bcstatRet;
+	return 0;
+}
+
 
-	return fsipc(FSREQ_SYNC, NULL);
+
+// Asynchronous I/O through the ring shared with the file server.
+// Each request owns one slot, and with it one data page of the ring.
+
+#define fsring		((struct Fsring *) FSRING_VA)
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_BUSY,		// submitted, not completed yet
+	SLOT_DONE		// completed, not waited for yet
+};
+
+static struct {
+	uint32_t op;
+	void *buf;		// where a read's data goes
+	int res;
+	int state;
+} fsring_slots[FSRING_SLOTS];
+static struct Mutex fsring_lock;
+
+static char *
+slot_data(int slot)
+{
+	return (char *) FSRING_VA + (slot + 1) * PGSIZE;
+}
+
+// Share a fresh ring with the file server, unless we already have one.
+// A fork()ed child starts without one, and forgets the parent's slots.
+static int
+fsring_setup(void)
+{
+	int i, r;
+
+	if ((uvpd[PDX(FSRING_VA)] & PTE_P) && (uvpt[PGNUM(FSRING_VA)] & PTE_P))
+		return 0;
+	for (i = 0; i < FSMAXPAGES; i++)
+		if ((r = sys_page_alloc(0, (char *) FSRING_VA + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			goto fail;
+	if ((r = fsipc_pages(FSREQ_RING_SETUP, fsring, FSMAXPAGES, NULL, 0)) < 0)
+		goto fail;
+	memset(fsring_slots, 0, sizeof(fsring_slots));
+	return 0;
+
+fail:
+	funmap(fsring, FSMAXPAGES * PGSIZE);
+	return r;
+}
+
+// Queue an asynchronous request.  For writes, buf holds the data;
+// for reads, it receives it in fs_async_wait.
+// Returns the request's handle, or < 0 on error.  Errors are:
+//	-E_AGAIN if FSRING_SLOTS requests are already in flight.
+static int
+fsring_submit(int fdnum, uint32_t op, void *buf, size_t n, off_t offset)
+{
+	struct Fd *fd;
+	struct Fssqe *sqe;
+	int slot, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = filebuf_sync(fd)) < 0)
+		return r;
+	n = MIN(n, PGSIZE);
+
+	mutex_lock(&fsring_lock);
+	if ((r = fsring_setup()) < 0)
+		goto out;
+	for (slot = 0; slot < FSRING_SLOTS; slot++)
+		if (fsring_slots[slot].state == SLOT_FREE)
+			break;
+	if (slot == FSRING_SLOTS) {
+		r = -E_AGAIN;
+		goto out;
+	}
+	fsring_slots[slot].op = op;
+	fsring_slots[slot].buf = buf;
+	fsring_slots[slot].state = SLOT_BUSY;
+	if (op == FSRING_WRITE)
+		memmove(slot_data(slot), buf, n);
+
+	// At most FSRING_SLOTS requests are queued, so there is room.
+	sqe = &fsring->sq[fsring->sq_tail % FSRING_SIZE];
+	sqe->sqe_op = op;
+	sqe->sqe_slot = slot;
+	sqe->sqe_fileid = fd->fd_file.id;
+	sqe->sqe_offset = offset;
+	sqe->sqe_len = n;
+	__sync_synchronize();
+	fsring->sq_tail++;
+	__sync_synchronize();
+	if (fsring->sq_wakeup && xchg(&fsring->sq_wakeup, 0))
+		ipc_send(fsenv(), FSREQ_RING_ENTER, fsring, PTE_P|PTE_U|PTE_W);
+	r = slot;
+out:
+	mutex_unlock(&fsring_lock);
+	return r;
+}
+
+// Start reading up to min(n, PGSIZE) bytes at 'offset' of 'fdnum'
+// into 'buf'.  'buf' must stay valid until fs_async_wait returns.
+// Returns a handle for fs_async_wait, or < 0 on error.
+int
+fs_async_read(int fdnum, void *buf, size_t n, off_t offset)
+{
+	return fsring_submit(fdnum, FSRING_READ, buf, n, offset);
+}
+
+// Start writing min(n, PGSIZE) bytes from 'buf' at 'offset' of 'fdnum'.
+// 'buf' may be reused as soon as this returns.
+// Returns a handle for fs_async_wait, or < 0 on error.
+int
+fs_async_write(int fdnum, const void *buf, size_t n, off_t offset)
+{
+	return fsring_submit(fdnum, FSRING_WRITE, (void *) buf, n, offset);
+}
+
+// Start flushing 'fdnum' to disk.
+// Returns a handle for fs_async_wait, or < 0 on error.
+int
+fs_async_fsync(int fdnum)
+{
+	return fsring_submit(fdnum, FSRING_FSYNC, NULL, 0, 0);
 }
 
+// Wait for the request 'handle' to complete, and return its result:
+// the number of bytes read or written, or < 0 on error.
+int
+fs_async_wait(int handle)
+{
+	struct Fscqe *cqe;
+	uint32_t tail;
+	int r;
+
+	if (handle < 0 || handle >= FSRING_SLOTS)
+		return -E_INVAL;
+	mutex_lock(&fsring_lock);
+	if (fsring_slots[handle].state == SLOT_FREE) {
+		mutex_unlock(&fsring_lock);
+		return -E_INVAL;
+	}
+	while (fsring_slots[handle].state != SLOT_DONE) {
+		// Collect whatever has completed, ours or not.
+		tail = fsring->cq_tail;
+		__sync_synchronize();
+		for (; fsring->cq_head != tail; fsring->cq_head++) {
+			cqe = &fsring->cq[fsring->cq_head % FSRING_SIZE];
+			fsring_slots[cqe->cqe_slot].res = cqe->cqe_res;
+			fsring_slots[cqe->cqe_slot].state = SLOT_DONE;
+		}
+		if (fsring_slots[handle].state == SLOT_DONE)
+			break;
+		atomic_add(&fsring->cq_waiters, 1);
+		mutex_unlock(&fsring_lock);
+		sys_futex_wait(&fsring->cq_tail, tail, 0);
+		atomic_add(&fsring->cq_waiters, -1);
+		mutex_lock(&fsring_lock);
+	}
+
+	r = fsring_slots[handle].res;
+	if (fsring_slots[handle].op == FSRING_READ && r > 0)
+		memmove(fsring_slots[handle].buf, slot_data(handle), r);
+	fsring_slots[handle].state = SLOT_FREE;
+	mutex_unlock(&fsring_lock);
+	return r;
+}
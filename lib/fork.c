@@ -141,6 +141,9 @@ fork(void)
 
     set_pgfault_handler(pgfault);
 
+    // send buffered file writes first, or both of us would
+    fs_flush_buffers();
+
     envid_t child_envid = sys_exofork();
 
     if (child_envid < 0) {
@@ -152,6 +155,7 @@ fork(void)
 
         // set thisenv to the child env
 		thisenv = curenv;
+		uthread_fork_child();
 		return 0;
 	}
 
@@ -179,8 +183,15 @@ fork(void)
                 continue;
             }
 
-            if (page_num == except_stack_num) {
-                // dont remap exception stack
+            if (page_num == except_stack_num
+                || uthread_is_xstack((uintptr_t)page_addr)) {
+                // dont remap exception stacks
+                continue;
+            }
+
+            if ((uintptr_t)page_addr >= FSRING_VA
+                && (uintptr_t)page_addr < FSRING_VA + FSMAXPAGES * PGSIZE) {
+                // the file server ring belongs to the parent
                 continue;
             }
 
@@ -229,6 +240,9 @@ sfork(void)
 
     set_pgfault_handler(pgfault);
 
+    // send buffered file writes first, or both of us would
+    fs_flush_buffers();
+
     envid_t child_envid = sys_exofork();
 
     if (child_envid < 0) {
@@ -238,7 +252,8 @@ sfork(void)
     if (child_envid == 0) {
 		// this is executed in the child
 
-        // dont "fix" thisenv, since both envs share it
+        // thisenv lives in a page of its own which is not shared
+		thisenv = curenv;
 		return 0;
 	}
 
@@ -264,9 +279,11 @@ sfork(void)
                 continue;
             }
 
-            if (page_num == except_stack_num) {
+            if (page_num == except_stack_num
+                || page_num == PGNUM(&uthread_main)) {
                 // dont remap exception stack,
-                // to prevent races between envs on page faults
+                // to prevent races between envs on page faults,
+                // or the page holding thisenv
                 continue;
             }
 
@@ -282,9 +299,10 @@ sfork(void)
         }
     }
 
-    // mark the stack as a COW page for both envs
+    // mark the stack and thisenv as COW pages for both envs
     uint32_t stack_num = PGNUM(USTACKTOP-PGSIZE);
     duppage(child_envid, stack_num);
+    duppage(child_envid, PGNUM(&uthread_main));
 
     // setup the page fault handler and allocate exception stack for child
     r = sys_page_alloc(child_envid, (void*)(UXSTACKTOP-PGSIZE),
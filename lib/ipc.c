@@ -21,6 +21,16 @@
 //   a perfectly valid place to map a page.)
 int32_t
 ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_pages(from_env_store, pg, 1, perm_store, NULL);
+}
+
+// Like ipc_recv, but accept up to 'maxpages' pages, mapped at
+// consecutive addresses from 'pg'.  If 'npages_store' is nonnull,
+// store the number of pages received in *npages_store.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, int maxpages,
+	       int *perm_store, int *npages_store)
 {
 	// LAB 4: Your code here.
     if (pg == NULL) {
@@ -28,17 +38,22 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
         pg = (void*)ULIM;
     }
 
-    int r = sys_ipc_recv(pg);
+    int r = sys_ipc_recv_pages(pg, maxpages);
 
+    // thisenv is per thread, and every thread receives its own messages
     if (perm_store != NULL) {
-        *perm_store = r < 0 ? 0 : curenv->env_ipc_perm;
+        *perm_store = r < 0 ? 0 : thisenv->env_ipc_perm;
     }
 
     if (from_env_store != NULL) {
-        *from_env_store = r < 0 ? 0 : curenv->env_ipc_from;
+        *from_env_store = r < 0 ? 0 : thisenv->env_ipc_from;
+    }
+
+    if (npages_store != NULL) {
+        *npages_store = r < 0 ? 0 : thisenv->env_ipc_npages;
     }
 
-	return r < 0 ? r : curenv->env_ipc_value;
+	return r < 0 ? r : thisenv->env_ipc_value;
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
@@ -51,6 +66,13 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
+{
+	ipc_send_pages(to_env, val, pg, 1, perm);
+}
+
+// Like ipc_send, but send the 'npages' pages starting at 'pg'.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, int npages, int perm)
 {
 	// LAB 4: Your code here.
     if (pg == NULL) {
@@ -60,7 +82,7 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
     int r = -E_IPC_NOT_RECV;
 
     while (1) {
-        r = sys_ipc_try_send(to_env, val, pg, perm);
+        r = sys_ipc_try_send_pages(to_env, val, pg, npages, perm);
         if (r == -E_IPC_NOT_RECV) {
             sys_yield();
         } else {
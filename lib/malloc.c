@@ -26,6 +26,11 @@ static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
 static uint8_t *mptr;
 
+// Threads share mptr and the page ref counts.
+static struct Mutex malloc_lock;
+
+static void free_locked(void *v);
+
 static int
 isfree(void *v, size_t n)
 {
@@ -38,8 +43,8 @@ isfree(void *v, size_t n)
 	return 1;
 }
 
-void*
-malloc(size_t n)
+static void*
+malloc_locked(size_t n)
 {
 	int i, cont;
 	int nwrap;
@@ -70,7 +75,7 @@ malloc(size_t n)
 		/*
 		 * stop working on this page and move on.
 		 */
-		free(mptr);	/* drop reference to this page */
+		free_locked(mptr);	/* drop reference to this page */
 		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
 	}
 
@@ -111,8 +116,8 @@ malloc(size_t n)
 	return v;
 }
 
-void
-free(void *v)
+static void
+free_locked(void *v)
 {
 	uint8_t *c;
 	uint32_t *ref;
@@ -138,3 +143,22 @@ free(void *v)
 		sys_page_unmap(0, c);
 }
 
+
+void*
+malloc(size_t n)
+{
+	void *v;
+
+	mutex_lock(&malloc_lock);
+	v = malloc_locked(n);
+	mutex_unlock(&malloc_lock);
+	return v;
+}
+
+void
+free(void *v)
+{
+	mutex_lock(&malloc_lock);
+	free_locked(v);
+	mutex_unlock(&malloc_lock);
+}
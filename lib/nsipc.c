@@ -7,6 +7,8 @@
 // Virtual address at which to receive page mappings containing client requests.
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
+// Each thread sends its requests from its own page.
+#define nsipcbuf (*(union Nsipc *) uthread_ipcbuf(&nsipcbuf))
 
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
@@ -19,9 +19,16 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// Blocked readers and writers sleep on the futex of the position they
+// are waiting for the other side to move.  A peer that closes or dies
+// does not wake them, so they also recheck pipeisclosed this often.
+#define PIPE_POLL_MS 10
+
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	volatile uint32_t p_rwait;	// number of readers asleep on p_wpos
+	volatile uint32_t p_wwait;	// number of writers asleep on p_rpos
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -101,6 +108,25 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Sleep until *pos moves away from old, the pipe may have closed,
+// or a spurious wakeup.  nwait counts the sleepers for the waker.
+static void
+pipe_wait(off_t *pos, off_t old, volatile uint32_t *nwait)
+{
+	atomic_add(nwait, 1);
+	sys_futex_wait((volatile uint32_t *) pos, old, PIPE_POLL_MS);
+	atomic_add(nwait, -1);
+}
+
+static void
+pipe_wake(off_t *pos, volatile uint32_t *nwait)
+{
+	// The locked add orders our update of *pos before the read of
+	// *nwait, pairing with the atomic_add in pipe_wait.
+	if (atomic_add(nwait, 0))
+		sys_futex_wake((volatile uint32_t *) pos, NENV);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
@@ -115,24 +141,28 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
+		off_t wpos;
+		while (p->p_rpos == (wpos = p->p_wpos)) {
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			pipe_wait(&p->p_wpos, wpos, &p->p_rwait);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+out:
+	// there's room now for any waiting writer
+	pipe_wake(&p->p_rpos, &p->p_wwait);
 	return i;
 }
 
@@ -150,17 +180,20 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 
 	buf = vbuf;
 	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+		off_t rpos;
+		while (p->p_wpos >= (rpos = p->p_rpos) + sizeof(p->p_buf)) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers drain what we wrote so far,
+			// then sleep until one of them moves rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wake(&p->p_wpos, &p->p_rwait);
+			pipe_wait(&p->p_rpos, rpos, &p->p_wwait);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +201,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(&p->p_wpos, &p->p_rwait);
 	return i;
 }
 
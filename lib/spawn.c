@@ -85,6 +85,11 @@ spawn(const char *prog, const char **argv)
 	//
 	//   - Start the child process running with sys_env_set_status().
 
+	// The child shares our open files but not their buffers, so it
+	// must see any writes still waiting in them.
+	if ((r = fs_flush_buffers()) < 0)
+		return r;
+
 	if ((r = open(prog, O_RDONLY)) < 0)
 		return r;
 	fd = r;
@@ -280,6 +285,12 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
+		} else if (!(perm & PTE_W) && i + PGSIZE <= filesz
+			   && fmap(fd, UTEMP, PGSIZE, fileoffset + i) == PGSIZE) {
+			// whole read-only page: share the file server's copy
+			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
+			sys_page_unmap(0, UTEMP);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
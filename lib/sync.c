@@ -0,0 +1,169 @@
+// Mutexes, condition variables and semaphores.
+//
+// The uncontended paths are a single atomic instruction; the kernel is
+// only entered to sleep (sys_futex_wait) or to wake someone who is
+// known to be sleeping (sys_futex_wake).
+
+#include <inc/lib.h>
+
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+	// Contended: mark the mutex as having waiters before sleeping,
+	// so the holder knows to wake us.  Whoever grabs it this way
+	// keeps state 2, which may cost one spurious wake on unlock.
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = xchg(&m->m_state, 2);
+	}
+}
+
+bool
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_futex_wake(&m->m_state, 1);
+}
+
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+}
+
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+// Like cond_wait, but give up after timeout_ms milliseconds
+// (0 means never).  Returns 0 or -E_TIMEOUT; m is held again either way.
+// As with any condition variable, wakeups may be spurious.
+int
+cond_timedwait(struct Cond *c, struct Mutex *m, unsigned timeout_ms)
+{
+	uint32_t seq = c->c_seq;
+	int r;
+
+	mutex_unlock(m);
+	// -E_AGAIN means a signal arrived after we read c_seq.
+	r = sys_futex_wait(&c->c_seq, seq, timeout_ms);
+	// Other waiters may be queued behind the mutex too.
+	while (xchg(&m->m_state, 2) != 0)
+		sys_futex_wait(&m->m_state, 2, 0);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	atomic_add(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	atomic_add(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, NENV);
+}
+
+void
+sem_init(struct Semaphore *s, uint32_t count)
+{
+	s->s_count = count;
+	s->s_waiters = 0;
+}
+
+bool
+sem_trywait(struct Semaphore *s)
+{
+	uint32_t v;
+
+	while ((v = s->s_count) > 0)
+		if (cmpxchg(&s->s_count, v, v - 1) == v)
+			return true;
+	return false;
+}
+
+void
+sem_wait(struct Semaphore *s)
+{
+	while (!sem_trywait(s)) {
+		atomic_add(&s->s_waiters, 1);
+		// Returns at once with -E_AGAIN if a post got in first.
+		sys_futex_wait(&s->s_count, 0, 0);
+		atomic_add(&s->s_waiters, -1);
+	}
+}
+
+void
+sem_post(struct Semaphore *s)
+{
+	atomic_add(&s->s_count, 1);
+	if (s->s_waiters)
+		sys_futex_wake(&s->s_count, 1);
+}
+
+void
+rwlock_init(struct RWLock *rw)
+{
+	memset(rw, 0, sizeof(*rw));
+}
+
+void
+rwlock_rdlock(struct RWLock *rw)
+{
+	mutex_lock(&rw->rw_mu);
+	while (rw->rw_writer || rw->rw_wwait)
+		cond_wait(&rw->rw_cond, &rw->rw_mu);
+	rw->rw_readers++;
+	mutex_unlock(&rw->rw_mu);
+}
+
+void
+rwlock_wrlock(struct RWLock *rw)
+{
+	mutex_lock(&rw->rw_mu);
+	rw->rw_wwait++;
+	while (rw->rw_writer || rw->rw_readers)
+		cond_wait(&rw->rw_cond, &rw->rw_mu);
+	rw->rw_wwait--;
+	rw->rw_writer = 1;
+	mutex_unlock(&rw->rw_mu);
+}
+
+// Release a read or write hold on rw.
+void
+rwlock_unlock(struct RWLock *rw)
+{
+	mutex_lock(&rw->rw_mu);
+	if (rw->rw_writer)
+		rw->rw_writer = 0;
+	else
+		rw->rw_readers--;
+	// Readers and writers share one condition, so wake them all
+	// and let them sort it out.
+	if (rw->rw_readers == 0)
+		cond_broadcast(&rw->rw_cond);
+	mutex_unlock(&rw->rw_mu);
+}
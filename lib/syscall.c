@@ -117,6 +117,18 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, int npages, int perm)
+{
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, npages);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, int maxpages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, maxpages, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
@@ -133,4 +145,22 @@ int sys_net_recv(void *va) {
 
 int sys_get_mac_addr(void *addr) {
     return syscall(SYS_get_mac_addr, true, (uint32_t)addr, 0, 0, 0, 0);
-}
\ No newline at end of file
+}
+
+envid_t sys_thread_create(void *eip, void *esp, void *xstacktop) {
+    return syscall(SYS_thread_create, false, (uint32_t)eip, (uint32_t)esp,
+                   (uint32_t)xstacktop, 0, 0);
+}
+
+int sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned timeout_ms) {
+    return syscall(SYS_futex_wait, false, (uint32_t)addr, val, timeout_ms,
+                   0, 0);
+}
+
+int sys_futex_wake(volatile uint32_t *addr, int n) {
+    return syscall(SYS_futex_wake, false, (uint32_t)addr, n, 0, 0, 0);
+}
+
+int sys_irq_listen(int irq) {
+    return syscall(SYS_irq_listen, false, irq, 0, 0, 0, 0);
+}
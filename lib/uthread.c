@@ -0,0 +1,217 @@
+// Preemptive user-level threads, one environment per thread.
+// See inc/uthread.h for the address space layout.
+
+#include <inc/lib.h>
+
+union UThreadMain uthread_main __attribute__((aligned(PGSIZE)));
+
+// Thread ids by slot; 0 marks a free slot, -1 a slot being set up.
+static volatile uthread_t uthread_ids[UTHREAD_MAX];
+static struct Mutex uthread_lock;
+
+static void
+lock(void)
+{
+	mutex_lock(&uthread_lock);
+}
+
+static void
+unlock(void)
+{
+	mutex_unlock(&uthread_lock);
+}
+
+static uintptr_t
+slot_addr(int i)
+{
+	return UTHREADS + i * UTHREAD_SIZE;
+}
+
+static struct UThread *
+slot_tls(int i)
+{
+	return (struct UThread *) (UTHREAD_STACKTOP(slot_addr(i))
+				   - sizeof(struct UThread));
+}
+
+// Unmap everything in slot i.
+static void
+slot_free(int i)
+{
+	uintptr_t va;
+
+	for (va = slot_addr(i); va < slot_addr(i) + UTHREAD_SIZE; va += PGSIZE)
+		sys_page_unmap(0, (void *) va);
+}
+
+// Map the stack, exception stack and IPC page of slot i.
+static int
+slot_alloc(int i)
+{
+	uintptr_t slot = slot_addr(i), va;
+	int r;
+
+	for (va = UTHREAD_STACK(slot); va < UTHREAD_STACKTOP(slot); va += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+			goto fail;
+	if ((r = sys_page_alloc(0, (void *) (UTHREAD_XSTACKTOP(slot) - PGSIZE),
+				PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	if ((r = sys_page_alloc(0, (void *) UTHREAD_IPCBUF(slot),
+				PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	slot_free(i);
+	return r;
+}
+
+// First code a new thread runs, on its own stack.
+static void
+uthread_start(void)
+{
+	struct UThread *t = uthread_tls();
+
+	t->ut_env = &envs[ENVX(sys_getenvid())];
+	uthread_exit(t->ut_func(t->ut_arg));
+}
+
+// Create a thread running func(arg) and store its id in *tid.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if all UTHREAD_MAX slots are in use
+//		or no environment is free.
+//	-E_NO_MEM on memory exhaustion.
+int
+uthread_create(uthread_t *tid, void *(*func)(void *), void *arg)
+{
+	struct UThread *t;
+	envid_t id;
+	int i, r;
+
+	lock();
+	if (uthread_main.t.ut_id == 0)
+		uthread_main.t.ut_id = thisenv->env_id;
+	for (i = 0; i < UTHREAD_MAX; i++)
+		if (uthread_ids[i] == 0)
+			break;
+	if (i == UTHREAD_MAX) {
+		unlock();
+		return -E_NO_FREE_ENV;
+	}
+	uthread_ids[i] = -1;
+	unlock();
+
+	if ((r = slot_alloc(i)) < 0)
+		goto fail;
+
+	t = slot_tls(i);
+	memset(t, 0, sizeof(*t));
+	t->ut_func = func;
+	t->ut_arg = arg;
+	t->ut_state = UT_RUNNING;
+
+	// uthread_start never returns, so its return address slot
+	// just keeps the stack 16-byte aligned.
+	id = sys_thread_create(uthread_start, (uint32_t *) t - 1,
+			       (void *) UTHREAD_XSTACKTOP(slot_addr(i)));
+	if (id < 0) {
+		r = id;
+		slot_free(i);
+		goto fail;
+	}
+	t->ut_id = id;
+	uthread_ids[i] = id;
+	*tid = id;
+	return 0;
+
+fail:
+	uthread_ids[i] = 0;
+	return r;
+}
+
+// Wait for thread tid to exit, store its return value in *ret_store
+// (if ret_store is nonnull) and free its resources.
+// Returns 0 on success, -E_INVAL if tid is not a joinable thread.
+int
+uthread_join(uthread_t tid, void **ret_store)
+{
+	const volatile struct Env *e = &envs[ENVX(tid)];
+	struct UThread *t;
+	int i;
+
+	for (i = 0; i < UTHREAD_MAX; i++)
+		if (uthread_ids[i] == tid && tid > 0)
+			break;
+	if (i == UTHREAD_MAX)
+		return -E_INVAL;
+	t = slot_tls(i);
+
+	while (t->ut_state != UT_EXITED)
+		sys_futex_wait(&t->ut_state, UT_RUNNING, 0);
+	// The thread may still be on its stack until the kernel frees it.
+	while (e->env_id == tid && e->env_status != ENV_FREE)
+		sys_yield();
+
+	if (ret_store)
+		*ret_store = t->ut_ret;
+	slot_free(i);
+	uthread_ids[i] = 0;
+	return 0;
+}
+
+// Terminate the calling thread, making ret available to uthread_join.
+// The rest of the program keeps running; use exit() to stop it all.
+void
+uthread_exit(void *ret)
+{
+	struct UThread *t = uthread_tls();
+
+	t->ut_ret = ret;
+	t->ut_state = UT_EXITED;
+	sys_futex_wake(&t->ut_state, NENV);
+	sys_env_destroy(0);
+	panic("uthread_exit: still alive");
+}
+
+uthread_t
+uthread_self(void)
+{
+	return thisenv->env_id;
+}
+
+// Destroy every thread of this program except the caller.
+// Called by exit().
+void
+uthread_kill_others(void)
+{
+	envid_t self = thisenv->env_id, main = uthread_main.t.ut_id;
+	int i;
+
+	if (main == 0)
+		return;		// never created a thread
+	lock();
+	for (i = 0; i < UTHREAD_MAX; i++)
+		if (uthread_ids[i] > 0 && uthread_ids[i] != self)
+			sys_env_destroy(uthread_ids[i]);
+	if (main != self)
+		sys_env_destroy(main);
+	unlock();
+}
+
+// Called in a fork()ed child, which starts out with just one thread:
+// the one that called fork.
+void
+uthread_fork_child(void)
+{
+	uintptr_t esp = read_esp();
+	int i;
+
+	uthread_main.t.ut_id = 0;
+	mutex_init(&uthread_lock);
+	for (i = 0; i < UTHREAD_MAX; i++)
+		uthread_ids[i] = 0;
+	// Keep the slot we are running on, if any, out of reach.
+	if (uthread_in_slot(esp))
+		uthread_ids[(esp - UTHREADS) / UTHREAD_SIZE] = thisenv->env_id;
+}
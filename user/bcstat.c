@@ -0,0 +1,31 @@
+#include <inc/lib.h>
+
+void
+usage(void)
+{
+	cprintf("usage: bcstat [budget]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStat st;
+	uint32_t budget = 0;
+	int r;
+
+	binaryname = "bcstat";
+	if (argc > 2)
+		usage();
+	if (argc == 2 && (budget = strtol(argv[1], 0, 0)) == 0)
+		usage();
+
+	if ((r = fs_bcstat(budget, &st)) < 0)
+		panic("fs_bcstat: %e", r);
+	printf("block cache: %d of %d blocks, %d dirty\n", st.bs_resident,
+	       st.bs_budget, st.bs_dirty);
+	printf("hits %d misses %d prefetched %d evictions %d writebacks %d\n",
+	       st.bs_hits, st.bs_misses, st.bs_prefetched, st.bs_evictions,
+	       st.bs_writebacks);
+	printf("disk sectors read or written %d\n", st.bs_sectors);
+}
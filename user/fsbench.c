@@ -0,0 +1,93 @@
+// Compare reading a file stored compressed with reading it stored as
+// it is, from a cold block cache.  Each fixture is repeated to fill a
+// file of NBLK blocks written both ways.  The files are left behind,
+// and truncated when the next run writes them again.
+
+#include <inc/lib.h>
+
+#define NBLK		64
+
+static char fixture[PGSIZE], buf[PGSIZE];
+
+static void
+makefile(const char *path, int omode, int n)
+{
+	int fd, i, r;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|omode)) < 0)
+		panic("open %s: %e", path, fd);
+	for (i = 0; i < PGSIZE; i++)
+		buf[i] = fixture[i % n];
+	for (i = 0; i < NBLK; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write %s: %e", path, r);
+	close(fd);
+}
+
+static void
+readfile(const char *path)
+{
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	while ((r = read(fd, buf, PGSIZE)) > 0)
+		;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	close(fd);
+}
+
+// Time reading path after reading other, which pushes path out of
+// the shrunken cache.
+static void
+bench(const char *name, const char *path, const char *other)
+{
+	struct BcStat st0, st1;
+	unsigned t0, t1, ms;
+	int r;
+
+	readfile(other);
+	if ((r = fs_bcstat(0, &st0)) < 0)
+		panic("fs_bcstat: %e", r);
+	t0 = sys_time_msec();
+	readfile(path);
+	t1 = sys_time_msec();
+	if ((r = fs_bcstat(0, &st1)) < 0)
+		panic("fs_bcstat: %e", r);
+	ms = t1 - t0 ? t1 - t0 : 1;
+	printf("  %-10s %4d KB in %4d ms: %5d KB/s, %d sectors\n", name,
+	       NBLK * PGSIZE / 1024, t1 - t0, NBLK * PGSIZE / ms,
+	       st1.bs_sectors - st0.bs_sectors);
+}
+
+void
+umain(int argc, char **argv)
+{
+	const char *fixtures[] = { "/lorem", "/index.html" };
+	struct BcStat st, tmp;
+	int fd, i, n, r;
+
+	binaryname = "fsbench";
+	if ((r = fs_bcstat(0, &st)) < 0)
+		panic("fs_bcstat: %e", r);
+	for (i = 0; i < 2; i++) {
+		if ((fd = open(fixtures[i], O_RDONLY)) < 0)
+			panic("open %s: %e", fixtures[i], fd);
+		if ((n = readn(fd, fixture, sizeof(fixture))) <= 0)
+			panic("read %s: %e", fixtures[i], n);
+		close(fd);
+
+		makefile("/fsbench.raw", 0, n);
+		makefile("/fsbench.z", O_COMPRESS, n);
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+		if ((r = fs_bcstat(BCMINBLOCKS, &tmp)) < 0)
+			panic("fs_bcstat: %e", r);
+		printf("%s:\n", fixtures[i]);
+		bench("plain", "/fsbench.raw", "/fsbench.z");
+		bench("compressed", "/fsbench.z", "/fsbench.raw");
+		if ((r = fs_bcstat(st.bs_budget, &tmp)) < 0)
+			panic("fs_bcstat: %e", r);
+	}
+}
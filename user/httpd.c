@@ -9,6 +9,7 @@
 #define E_BAD_REQ	1000
 
 #define BUFFSIZE 512
+#define FILEMAP ((char *) 0x40000000)	// where send_data maps files
 #define MAXPENDING 5	// Max connection requests
 
 struct http_request {
@@ -77,16 +78,19 @@ static int
 send_data(struct http_request *req, int fd)
 {
 	// LAB 6: Your code here.
+	// Map the file instead of reading it, so its data goes from
+	// the file server's block cache to the socket without a copy.
 	struct Stat stat;
 	fstat(fd, &stat);
 	off_t size = stat.st_size;
-	char buff[size];
-	if ((read(fd, (void*)buff, (size_t)size)) != size){
+	if (fmap(fd, FILEMAP, size, 0) != size){
+		funmap(FILEMAP, size);
 		return -1;
 	}
-	if (write(req->sock, buff, size) != size){
+	if (write(req->sock, FILEMAP, size) != size){
 		die("Failed to send data to client");
 	}
+	funmap(FILEMAP, size);
 	return 0;
 }
 
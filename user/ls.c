@@ -22,18 +22,18 @@ ls(const char *path, const char *prefix)
 void
 lsdir(const char *path, const char *prefix)
 {
-	int fd, n;
-	struct File f;
+	static struct Dirent ents[FSDIRENTS];
+	int fd, i, n;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
 		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
+	while ((n = readdir(fd, ents, FSDIRENTS)) > 0)
+		for (i = 0; i < n; i++)
+			ls1(prefix, ents[i].d_type==FTYPE_DIR, ents[i].d_size,
+			    ents[i].d_name);
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
+	close(fd);
 }
 
 void
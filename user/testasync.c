@@ -0,0 +1,78 @@
+// test asynchronous file I/O through the file server ring
+
+#include <inc/lib.h>
+
+#define NBLK	8
+
+static char wbuf[NBLK][PGSIZE], rbuf[NBLK][PGSIZE];
+
+static void
+fill(int i)
+{
+	int j;
+
+	for (j = 0; j < PGSIZE; j++)
+		wbuf[i][j] = 'a' + (i * 7 + j) % 26;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, h[FSRING_SLOTS], i, r;
+	envid_t child;
+
+	if ((fd = open("/async", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /async: %e", fd);
+
+	// Queue a page-sized write per block, then wait out of order.
+	for (i = 0; i < NBLK; i++) {
+		fill(i);
+		if ((h[i] = fs_async_write(fd, wbuf[i], PGSIZE, i * PGSIZE)) < 0)
+			panic("fs_async_write %d: %e", i, h[i]);
+	}
+	for (i = NBLK - 1; i >= 0; i--)
+		if ((r = fs_async_wait(h[i])) != PGSIZE)
+			panic("async write %d returned %d", i, r);
+	if ((r = fs_async_wait(fs_async_fsync(fd))) < 0)
+		panic("async fsync: %e", r);
+	cprintf("async write OK\n");
+
+	for (i = 0; i < NBLK; i++)
+		if ((h[i] = fs_async_read(fd, rbuf[i], PGSIZE, i * PGSIZE)) < 0)
+			panic("fs_async_read %d: %e", i, h[i]);
+	for (i = 0; i < NBLK; i++) {
+		if ((r = fs_async_wait(h[i])) != PGSIZE)
+			panic("async read %d returned %d", i, r);
+		if (memcmp(rbuf[i], wbuf[i], PGSIZE) != 0)
+			panic("async read %d got wrong data", i);
+	}
+	if ((r = fs_async_wait(h[0])) != -E_INVAL)
+		panic("second wait on a handle: got %e", r);
+	cprintf("async read OK\n");
+
+	// Fill every slot: one more must be refused.
+	for (i = 0; i < FSRING_SLOTS; i++)
+		if ((h[i] = fs_async_read(fd, rbuf[i % NBLK], 16, 0)) < 0)
+			panic("fs_async_read %d: %e", i, h[i]);
+	if ((r = fs_async_read(fd, rbuf[0], 16, 0)) != -E_AGAIN)
+		panic("read with a full ring: got %e", r);
+	for (i = 0; i < FSRING_SLOTS; i++)
+		if ((r = fs_async_wait(h[i])) != 16)
+			panic("async read %d returned %d", i, r);
+	cprintf("async ring full OK\n");
+
+	// A child sets up its own ring.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = fs_async_wait(fs_async_read(fd, rbuf[0], PGSIZE,
+						     PGSIZE))) != PGSIZE)
+			panic("async read in child returned %d", r);
+		if (memcmp(rbuf[0], wbuf[1], PGSIZE) != 0)
+			panic("async read in child got wrong data");
+		exit();
+	}
+	wait(child);
+	cprintf("async fork OK\n");
+	close(fd);
+}
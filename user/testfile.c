@@ -21,10 +21,11 @@ xopen(const char *path, int mode)
 void
 umain(int argc, char **argv)
 {
-	int r, f, i;
+	int r, f, f2, i, n;
 	struct Fd *fd;
 	struct Fd fdcopy;
 	struct Stat st;
+	struct Dirent de;
 	char buf[512];
 
 	// We open files manually first, to avoid the FD layer
@@ -124,5 +125,71 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
-}
 
+	// Closed files must free their server slots, but not while a
+	// forked child still shares the Fd.
+	for (i = 0; i < 2 * 1024; i++) {
+		if ((f = open("/newmotd", O_RDONLY)) < 0)
+			panic("open /newmotd #%d: %e", i, f);
+		close(f);
+	}
+	if ((f = open("/newmotd", O_RDONLY)) < 0)
+		panic("open /newmotd: %e", f);
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		close(f);
+		exit();
+	}
+	wait(r);
+	if ((r = readn(f, buf, 1)) != 1)
+		panic("read after child's close returned %e", r);
+	close(f);
+	cprintf("open file table is good\n");
+
+	// Every file in / shows up once, with the size stat reports.
+	if ((r = stat("/newmotd", &st)) < 0)
+		panic("stat /newmotd: %e", r);
+	if (st.st_isdir)
+		panic("stat /newmotd says it is a directory");
+	if ((f = open("/", O_RDONLY)) < 0)
+		panic("open /: %e", f);
+	n = 0;
+	while ((r = readdir(f, &de, 1)) == 1)
+		if (strcmp(de.d_name, "newmotd") == 0) {
+			if (de.d_size != st.st_size || de.d_type != FTYPE_REG)
+				panic("readdir returned bad entry for newmotd");
+			n++;
+		}
+	if (r < 0)
+		panic("readdir /: %e", r);
+	if (n != 1)
+		panic("readdir found newmotd %d times", n);
+	close(f);
+	cprintf("readdir is good\n");
+
+	// Small writes are collected before they go to the server, and
+	// a buffered read notices a change made through another fd.
+	if ((f = open("/buffered", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("creat /buffered: %e", f);
+	for (i = 0; i < 100; i++)
+		if ((r = write(f, "x", 1)) != 1)
+			panic("write /buffered@%d: %e", i, r);
+	if ((r = fstat(f, &st)) < 0)
+		panic("fstat /buffered: %e", r);
+	if (st.st_size != 100)
+		panic("/buffered has size %d, want 100", st.st_size);
+	seek(f, 0);
+	if ((r = readn(f, buf, 10)) != 10 || buf[0] != 'x')
+		panic("read /buffered: %e", r);
+	if ((f2 = open("/buffered", O_WRONLY)) < 0)
+		panic("open /buffered: %e", f2);
+	if ((r = write(f2, "y", 1)) != 1)
+		panic("write /buffered: %e", r);
+	close(f2);
+	seek(f, 0);
+	if ((r = read(f, buf, 1)) != 1 || buf[0] != 'y')
+		panic("buffered read missed a change");
+	close(f);
+	cprintf("file buffering is good\n");
+}
@@ -0,0 +1,76 @@
+// test that FPU/SSE state survives context switches and fork
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NYIELD	200
+
+static void
+load_xmm(uint32_t seed)
+{
+	uint32_t v[4] __attribute__((aligned(16))) = { seed, ~seed, seed * 3, seed ^ 0x5a5a5a5a };
+
+	asm volatile("movdqa %0, %%xmm0\n"
+		     "movdqa %%xmm0, %%xmm1\n"
+		     "movdqa %%xmm0, %%xmm7\n"
+		     : : "m" (v));
+}
+
+static bool
+check_xmm(uint32_t seed)
+{
+	uint32_t v[3][4] __attribute__((aligned(16)));
+
+	asm volatile("movdqa %%xmm0, %0\n"
+		     "movdqa %%xmm1, %1\n"
+		     "movdqa %%xmm7, %2\n"
+		     : "=m" (v[0]), "=m" (v[1]), "=m" (v[2]));
+	for (int i = 0; i < 3; i++)
+		if (v[i][0] != seed || v[i][1] != ~seed ||
+		    v[i][2] != seed * 3 || v[i][3] != (seed ^ 0x5a5a5a5a))
+			return false;
+	return true;
+}
+
+static void
+spin_and_check(uint32_t seed)
+{
+	volatile double x = 1.0;
+	int i;
+
+	load_xmm(seed);
+	for (i = 0; i < NYIELD; i++) {
+		x = x * 1.5 + seed;
+		sys_yield();
+		if (!check_xmm(seed))
+			panic("env %08x: xmm state lost after %d yields",
+			      thisenv->env_id, i);
+	}
+	if (x != x)	// NaN: x87 state was trashed
+		panic("env %08x: x87 state lost", thisenv->env_id);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD];
+	uint32_t seed = 0x12345678;
+	int i;
+
+	load_xmm(seed);
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			if (!check_xmm(seed))
+				panic("child did not inherit parent's xmm state");
+			spin_and_check(0x1000 * (i + 1) + i);
+			exit();
+		}
+	}
+
+	spin_and_check(seed);
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+	cprintf("fpu state preserved\n");
+}
@@ -0,0 +1,157 @@
+// test futexes and the mutex/condvar/semaphore built on them,
+// both between threads and between envs sharing a page
+
+#include <inc/lib.h>
+
+#define NTHREADS	4
+#define NITER		2000
+#define NITEMS		100
+#define QSIZE		4
+
+static struct Mutex mu;
+static volatile int counter;
+
+static struct Mutex qmu;
+static struct Cond qnotempty, qnotfull;
+static int queue[QSIZE], qhead, qtail;
+
+static struct RWLock rw;
+static volatile int rwa, rwb, rwbad;
+
+#define SHARED	((struct Semaphore *) 0xb0000000)
+#define ALIAS	((struct Semaphore *) 0xb0001000)
+
+static void *
+incr(void *arg)
+{
+	int i, v;
+
+	for (i = 0; i < NITER; i++) {
+		mutex_lock(&mu);
+		v = counter;
+		if (i % 64 == 0)
+			sys_yield();	// make the critical section race-prone
+		counter = v + 1;
+		mutex_unlock(&mu);
+	}
+	return 0;
+}
+
+// Writers keep rwa == rwb, but not in between.
+static void *
+rwuser(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NITER / 4; i++) {
+		if ((int) arg) {
+			rwlock_wrlock(&rw);
+			rwa++;
+			if (i % 16 == 0)
+				sys_yield();
+			rwb++;
+		} else {
+			rwlock_rdlock(&rw);
+			if (rwa != rwb)
+				rwbad++;
+		}
+		rwlock_unlock(&rw);
+	}
+	return 0;
+}
+
+static void *
+producer(void *arg)
+{
+	int i;
+
+	for (i = 1; i <= NITEMS; i++) {
+		mutex_lock(&qmu);
+		while (qtail - qhead == QSIZE)
+			cond_wait(&qnotfull, &qmu);
+		queue[qtail++ % QSIZE] = i;
+		cond_signal(&qnotempty);
+		mutex_unlock(&qmu);
+	}
+	return 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uthread_t tids[NTHREADS];
+	uint32_t word = 5, t0;
+	int i, r, sum;
+	envid_t child;
+
+	// raw futex calls
+	if ((r = sys_futex_wait(&word, 6, 0)) != -E_AGAIN)
+		panic("futex_wait on changed word: got %e", r);
+	t0 = sys_time_msec();
+	if ((r = sys_futex_wait(&word, 5, 50)) != -E_TIMEOUT)
+		panic("futex_wait timeout: got %e", r);
+	if (sys_time_msec() - t0 < 50)
+		panic("futex_wait timed out after %d ms", sys_time_msec() - t0);
+	if ((r = sys_futex_wake(&word, 1)) != 0)
+		panic("futex_wake with no waiters woke %d", r);
+	cprintf("futex wait/wake OK\n");
+
+	// mutex
+	for (i = 0; i < NTHREADS; i++)
+		if ((r = uthread_create(&tids[i], incr, 0)) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < NTHREADS; i++)
+		uthread_join(tids[i], 0);
+	if (counter != NTHREADS * NITER)
+		panic("mutex: counter is %d, want %d", counter, NTHREADS * NITER);
+	cprintf("mutex OK\n");
+
+	// condition variables: bounded buffer
+	if ((r = uthread_create(&tids[0], producer, 0)) < 0)
+		panic("uthread_create: %e", r);
+	for (sum = 0, i = 0; i < NITEMS; i++) {
+		mutex_lock(&qmu);
+		while (qhead == qtail)
+			cond_wait(&qnotempty, &qmu);
+		sum += queue[qhead++ % QSIZE];
+		cond_signal(&qnotfull);
+		mutex_unlock(&qmu);
+	}
+	uthread_join(tids[0], 0);
+	if (sum != NITEMS * (NITEMS + 1) / 2)
+		panic("condvar: sum is %d", sum);
+	cprintf("condvar OK\n");
+
+	// reader/writer lock: half readers, half writers
+	for (i = 0; i < NTHREADS; i++)
+		if ((r = uthread_create(&tids[i], rwuser, (void *) (i % 2))) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < NTHREADS; i++)
+		uthread_join(tids[i], 0);
+	if (rwbad || rwa != NTHREADS / 2 * (NITER / 4))
+		panic("rwlock: %d torn reads, %d writes", rwbad, rwa);
+	cprintf("rwlock OK\n");
+
+	// semaphore in a PTE_SHARE page, posted by a child through a
+	// different virtual address
+	if ((r = sys_page_alloc(0, SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	sem_init(SHARED, 0);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((r = sys_page_map(0, SHARED, 0, ALIAS, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_map: %e", r);
+		for (i = 0; i < 10; i++) {
+			sys_yield();
+			sem_post(ALIAS);
+		}
+		exit();
+	}
+	for (i = 0; i < 10; i++)
+		sem_wait(SHARED);
+	if (sem_trywait(SHARED))
+		panic("semaphore: too many posts");
+	wait(child);
+	cprintf("semaphore OK\n");
+}
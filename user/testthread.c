@@ -0,0 +1,81 @@
+// test preemptive threads: shared memory, per-thread thisenv,
+// malloc from many threads at once, and ipc between threads
+
+#include <inc/lib.h>
+
+#define NTHREADS	6
+#define NALLOC		200
+
+static volatile uint32_t started;
+
+static void *
+worker(void *arg)
+{
+	int id = (int) arg, i;
+	uint32_t *p[8];
+
+	if (thisenv->env_id != sys_getenvid())
+		panic("thread %d: thisenv is %08x, not %08x",
+		      id, thisenv->env_id, sys_getenvid());
+	__sync_fetch_and_add(&started, 1);
+
+	for (i = 0; i < NALLOC; i++) {
+		int j = i % 8;
+		if (i >= 8) {
+			if (*p[j] != id * 1000 + i - 8)
+				panic("thread %d: malloc block clobbered", id);
+			free(p[j]);
+		}
+		if ((p[j] = malloc(16 + 8 * id)) == 0)
+			panic("thread %d: malloc failed", id);
+		*p[j] = id * 1000 + i;
+		if (i % 16 == 0)
+			sys_yield();
+	}
+	for (i = 0; i < 8; i++)
+		free(p[i]);
+	return (void *) (id * id);
+}
+
+static void *
+echo(void *arg)
+{
+	envid_t who;
+	int32_t v;
+
+	while ((v = ipc_recv(&who, 0, 0)) != 0)
+		ipc_send(who, v + 1, 0, 0);
+	return 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uthread_t tids[NTHREADS], t;
+	void *ret;
+	int i, r;
+
+	for (i = 0; i < NTHREADS; i++)
+		if ((r = uthread_create(&tids[i], worker, (void *) i)) < 0)
+			panic("uthread_create: %e", r);
+	for (i = 0; i < NTHREADS; i++) {
+		if ((r = uthread_join(tids[i], &ret)) < 0)
+			panic("uthread_join: %e", r);
+		if ((int) ret != i * i)
+			panic("thread %d returned %d", i, (int) ret);
+	}
+	if (started != NTHREADS)
+		panic("only %d threads ran", started);
+	cprintf("threads share memory and malloc OK\n");
+
+	if ((r = uthread_create(&t, echo, 0)) < 0)
+		panic("uthread_create: %e", r);
+	for (i = 1; i < 10; i++) {
+		ipc_send(t, i, 0, 0);
+		if ((r = ipc_recv(0, 0, 0)) != i + 1)
+			panic("ipc with thread: got %d, want %d", r, i + 1);
+	}
+	ipc_send(t, 0, 0, 0);
+	uthread_join(t, 0);
+	cprintf("threads ipc OK\n");
+}